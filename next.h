@@ -9,9 +9,10 @@
 //
 //      - 4 zoom modes
 //      - Original 48K ULA (including border)
-//      - 1MB Memory Map (64 pages).
+//      - Up to 2MB of RAM (1MB, 64 16K banks, by default).
 //      - Layer 2.
 //      - Full RAM bank switching to $c000
+//      - Palettes (registers $40-$44)
 //
 // Future features planned to be implemented:
 //
@@ -25,6 +26,19 @@
 // NX_IMPLEMENTATION defined otherwise you will get linker errors as the linker will not find the implementation of
 // the API.
 //
+// On Linux and other X11 platforms, define NX_USE_X11 when you define NX_IMPLEMENTATION to get a window, and link with
+// -lX11 -lXext -lpthread.  The image is shown through MIT-SHM shared memory when the X server supports it.
+//
+// Define NX_HEADLESS to build without a window.  Without a window backend for the platform, or if the window cannot
+// be opened (e.g. there is no X display), every context is headless.  Headless contexts run a frame on every nxUpdate,
+// as fast as they are called, and render into an image you fetch with nxFrameBuffer.
+//
+// Contexts are independent of each other.  Different threads can open, run and close headless contexts at the same
+// time, as long as only one thread uses a context at a time; the shared tables are built once, by whichever context
+// needs them first.  Windowed contexts share the process's window system connection, so open, update and close all
+// of them on one thread (headless contexts can still run on others).  The file, PNG and NIM routines that don't take
+// a context can be called from any thread.
+//
 // Some keys have functionality:
 //
 //      ESC     Quit the current window
@@ -38,6 +52,11 @@
 
 #pragma once
 
+// The implementation needs POSIX clocks, threads and memory mapping, which strict C modes hide
+#if defined(NX_IMPLEMENTATION) && !defined(_WIN32) && !defined(_DEFAULT_SOURCE)
+#   define _DEFAULT_SOURCE
+#endif
+
 #include <stdint.h>
 
 //----------------------------------------------------------------------------------------------------------------------
@@ -99,16 +118,29 @@ typedef void(*NxFrameRoutine)(Next);
 // Implement this routines as your entry routine.
 int nxMain(int argc, char** argv);
 
+// Configuration for nxOpenEx.  Zero initialise it for the defaults.
+typedef struct
+{
+    nxBool      headless;       // No window, even if the platform has one.  nxUpdate runs one frame per call.
+    int         scale;          // Initial window zoom, 1-4.  Default (0) is 4.
+    int         ramSize;        // RAM in KB, rounded up to a whole 16K bank, 256-2048.  Default (0) is 1024.  Banks
+                                // only take host memory once they are written to.
+}
+NxConfig;
+
 // Create a new Next context.  Will act on the command line parameters it knows, and ignore the others
 Next nxOpen();
 
+// Create a new Next context with a configuration.  A null config is the same as nxOpen().
+Next nxOpenEx(const NxConfig* config);
+
 // Destroy the context
 void nxClose(Next N);
 
 // Update the message pump to the windows.  This will interface with the OS and should be called as much as possible.
 // Interleave calls here with your own code.  This will return NX_NO, when there are no more windows open.  Every
 // beginning of the frame, an optional function is called before the screen is redrawn.  The screen is only redrawn
-// if nxRedraw() is called or if 16 frames have passed (to update the flash state).
+// if nxRedraw() is called or if 16 frames have passed and there are flashing cells to update.
 nxBool nxUpdate(Next N, NxFrameRoutine f);
 
 // Open a console for logging.  "printf"s will be forwarded to this console.  It supports ANSI colour codes if that's
@@ -118,11 +150,148 @@ void nxConsoleOpen();
 // Single the window to be redrawn on the next nxUpdate().  Will not actually redraw if nothing visual has changed.
 void nxRedraw(Next N);
 
+// Run count frames back to back without waiting for the clock, calling f at the start of each, as if that much time
+// had passed.  Frames are shown according to NX_OPTION_RENDER_INTERVAL.  The window is still pumped, and this returns
+// NX_NO if it was closed, after which no more frames are run.  nxUpdate carries on in real time afterwards.
+nxBool nxRunFrames(Next N, NxFrameRoutine f, int count);
+
+// Size of the image, including the border.
+#define NX_FRAME_WIDTH      320
+#define NX_FRAME_HEIGHT     256
+
+// Return the rendered image as NX_FRAME_WIDTH x NX_FRAME_HEIGHT ARGB pixels, rows top to bottom.  Any changes not yet
+// rendered are rendered first.  The pointer is valid until the context is closed.  In NX_RENDER_MODE_THREADED the
+// render thread has its own image, so this is the image from before threaded rendering started.
+const nxDword* nxFrameBuffer(Next N);
+
+// Return the image zoomed by NX_OPTION_SCALE, which is (NX_FRAME_WIDTH * scale) x (NX_FRAME_HEIGHT * scale) pixels.
+// The size is written to width and height if they are not null.  The image is valid until the next call to this or
+// until the context is closed.
+const nxDword* nxScaledFrameBuffer(Next N, int* width, int* height);
+
+//----------------------------------------------------------------------------------------------------------------------
+// Options API
+//
+// Options tune how the mock does its work without changing what it emulates.  They can be changed at any time.
+//----------------------------------------------------------------------------------------------------------------------
+
+typedef enum
+{
+    NX_OPTION_RENDER_PATH,      // Code path used by the renderer (NxRenderPath).  Default is NX_RENDER_AUTO.
+    NX_OPTION_RENDER_THREADS,   // Number of threads rendering the frame in bands, including the calling thread.
+                                // 0 or 1 renders on the calling thread only (the default).
+    NX_OPTION_RENDER_MODE,      // When the image is rendered (NxRenderMode).  Default is NX_RENDER_MODE_FRAME.
+    NX_OPTION_SCALE,            // Zoom of the window and nxScaledFrameBuffer, 1-4.  F1-F4 also set it.  Default is
+                                // NxConfig.scale, or 4.
+    NX_OPTION_FRAME_PACING,     // 1 (the default) to wait in nxUpdate until the next frame is due or there is input,
+                                // so an idle loop does not use a whole core.  0 returns straight away, so code in the
+                                // loop runs as often as possible.  Headless contexts never wait.
+    NX_OPTION_TURBO,            // 1 to run a frame on every nxUpdate without waiting for the clock, showing frames
+                                // according to NX_OPTION_RENDER_INTERVAL.  Default is 0.
+    NX_OPTION_RENDER_INTERVAL,  // In turbo mode and nxRunFrames, show every Nth frame.  0 never shows them, although
+                                // nxFrameBuffer still renders the latest state.  Default is 1.
+    NX_OPTION_MAX_CATCH_UP,     // Most frames nxUpdate runs in one call when it has fallen behind, e.g. because the
+                                // host stalled.  Frames due beyond this are dropped.  At least 1, default is 5.
+    NX_OPTION_CATCH_UP_SKIP_RENDER, // 1 (the default) to only show the last of the frames nxUpdate runs to catch up.
+}
+NxOption;
+
+typedef enum
+{
+    NX_RENDER_MODE_FRAME,       // Render the changes to the whole frame when the window is redrawn
+    NX_RENDER_MODE_SCANLINE,    // Render each line as emulated time reaches it during nxUpdate, with the border,
+                                // Layer 2 and memory state of that moment.  Mid-frame changes show like the hardware.
+    NX_RENDER_MODE_THREADED,    // Snapshot video memory at the end of each frame and render and present it on a
+                                // separate thread, so the frame routine never waits for rendering.  Headless
+                                // contexts have nothing to present, and stay in NX_RENDER_MODE_FRAME.
+}
+NxRenderMode;
+
+typedef enum
+{
+    NX_RENDER_AUTO,             // Choose the fastest path the CPU supports
+    NX_RENDER_REFERENCE,        // Simple pixel-by-pixel renderer, kept to validate the others against
+    NX_RENDER_TABLE,            // Table driven renderer, plain C
+    NX_RENDER_SSE2,             // Table driven renderer, 4 pixels per store
+    NX_RENDER_AVX2,             // Table driven renderer, 8 pixels per store
+}
+NxRenderPath;
+
+// Set an option.  If a render path is not supported by the CPU, the next fastest one is used instead.
+void nxSetOption(Next N, NxOption option, int value);
+
+// Read an option.  NX_OPTION_RENDER_PATH returns the path actually in use, never NX_RENDER_AUTO.
+int nxGetOption(Next N, NxOption option);
+
+//----------------------------------------------------------------------------------------------------------------------
+// Statistics API
+//----------------------------------------------------------------------------------------------------------------------
+
+typedef struct
+{
+    nxQword     frames;             // Frames run since the context was opened
+    nxFloat     sleepTime;          // Total seconds nxUpdate has waited for frames to be due or for input
+    nxFloat     lastSleepTime;      // Seconds waited by the last call to nxUpdate
+    nxQword     caughtUpFrames;     // Extra frames nxUpdate has run because it had fallen behind
+    nxQword     droppedFrames;      // Frames that were due but never run, because of NX_OPTION_MAX_CATCH_UP
+    int         committedBanks;     // 16K banks of RAM allocated: when first written to, or to copy a bank that a
+                                    // snapshot shares
+}
+NxStats;
+
+// Fill in the statistics for the context.
+void nxGetStats(Next N, NxStats* stats);
+
+//----------------------------------------------------------------------------------------------------------------------
+// Fleet API
+//
+// A fleet is a set of headless contexts that run the same frame routine, spread across a pool of threads, for example
+// to search level seeds or replay regression runs.  Set each context up through nxFleetContext, run them all with
+// nxFleetRun, then collect the results.  Frame routines run on the pool's threads, but each context is only ever run
+// by one thread at a time, so a routine may use its context freely.  Use nxFleetIndex to tell the contexts apart.
+//----------------------------------------------------------------------------------------------------------------------
+
+typedef struct _NxFleet* NxFleet;
+
+typedef struct
+{
+    nxQword     frames;             // Frames the context has run in the fleet
+    nxDword     frameHash;          // CRC-32 of the context's image (nxFrameBuffer) after the last nxFleetRun
+    nxBool      stopped;            // nxFleetStop ended the last nxFleetRun early
+}
+NxFleetResult;
+
+// Open count headless contexts, run by numThreads threads including the calling one.  0 uses one thread per core.
+// NX_OPTION_RENDER_INTERVAL is 0 on the contexts, so they only render for nxFrameBuffer and the frame hash.
+NxFleet nxFleetOpen(int count, int numThreads);
+
+// Close the fleet and all its contexts.
+void nxFleetClose(NxFleet F);
+
+// Return the number of contexts in the fleet, and one of them.
+int nxFleetCount(NxFleet F);
+Next nxFleetContext(NxFleet F, int index);
+
+// Return the index of a context in its fleet, or -1 if it is not in one.
+int nxFleetIndex(Next N);
+
+// Run frames frames back to back on every context, calling f at the start of each frame, and return when they have
+// all finished.  Threads take the next context that has not started as they become free, so contexts that run slowly
+// don't hold up the others.
+void nxFleetRun(NxFleet F, NxFrameRoutine f, int frames);
+
+// Called from a frame routine: run no more frames on this context in the current nxFleetRun.
+void nxFleetStop(Next N);
+
+// Fill in the result of a context.
+void nxFleetGetResult(NxFleet F, int index, NxFleetResult* result);
+
 //----------------------------------------------------------------------------------------------------------------------
 // Memory API
 //
-// This API can only see 64K.  Any writes past 64K will wrap around, just like the real hardware.  Mass writing
-// functions like nxPokeBuffer and nxPokeFile will not wrap around, but rather error if there is too much data.
+// This API can only see 64K.  Any writes past 64K will wrap around, just like the real hardware.  Mass reading and
+// writing functions like nxPokeBuffer, nxPeekBuffer, nxFill and nxPokeFile will not wrap around, but rather error if
+// there is too much data.  The Ex versions work within one bank, and error if they would run past its end.
 //
 //----------------------------------------------------------------------------------------------------------------------
 
@@ -159,6 +328,57 @@ nxByte nxPeekEx(Next N, nxByte bank, nxWord p);
 // Read a 16-bit value directly from a bank.
 nxWord nxPeek16Ex(Next N, nxByte bank, nxWord p);
 
+// Read memory contents from the address.  Will return NX_NO if there is not that much memory after the address.
+nxBool nxPeekBuffer(Next N, nxWord address, void* buffer, nxWord size);
+
+// Read memory contents directly from a bank.  Will return NX_NO if there is not that much memory after the address.
+nxBool nxPeekBufferEx(Next N, nxByte bank, nxWord address, void* buffer, nxWord size);
+
+// Fill memory at the address with a byte.  Will return NX_NO if there is not that much memory after the address.
+nxBool nxFill(Next N, nxWord address, nxByte b, nxWord size);
+
+// Fill memory directly in a bank with a byte.  Will return NX_NO if there is not that much memory after the address.
+nxBool nxFillEx(Next N, nxByte bank, nxWord address, nxByte b, nxWord size);
+
+// Copy memory from one address to another, reading and writing through the current mapping.  The areas may overlap.
+// Will return NX_NO if either area runs past 64K.
+nxBool nxMemCopy(Next N, nxWord dst, nxWord src, nxWord size);
+
+// Every write to a bank, through any of the functions above, is tracked in 256-byte blocks, so tools like savers and
+// debuggers can find what has changed without comparing all of memory.  Restoring a snapshot counts as writing every
+// bank that it changes.
+
+#define NX_ALL_BANKS        0xff
+
+// Return the blocks of a bank written since the context was opened or nxDirtyClear was called on the bank.  Bit n is
+// set if any of the bytes $n00-$nff in the bank have been written.  Banks past the end of RAM return 0.
+nxQword nxDirtyQuery(Next N, nxByte bank);
+
+// Forget the writes to a bank, or to every bank if bank is NX_ALL_BANKS.
+void nxDirtyClear(Next N, nxByte bank);
+
+//----------------------------------------------------------------------------------------------------------------------
+// Snapshot API
+//
+// A snapshot holds a context's RAM and hardware state: the MMU and paging, Layer 2, the palettes, the border and the
+// flash phase.  Snapshots share banks with the context instead of copying them, and a bank is only copied when it is
+// next written to, so taking or restoring a snapshot costs little more than the banks written in between.  This makes
+// it practical to save and return to a state thousands of times, e.g. to explore different branches in a test.
+//----------------------------------------------------------------------------------------------------------------------
+
+typedef struct _NxSnapshot* NxSnapshot;
+
+// Take a snapshot of the context's current state.
+NxSnapshot nxSnapshot(Next N);
+
+// Return a context to the state in a snapshot.  A snapshot can be restored any number of times, into any context with
+// the same RAM size, including contexts run on other threads, as long as it is not freed at the same time.  Returns
+// NX_NO if the RAM sizes differ.
+nxBool nxRestore(Next N, NxSnapshot S);
+
+// Free a snapshot.  Contexts that have been restored from it are not affected.
+void nxSnapshotFree(NxSnapshot S);
+
 //----------------------------------------------------------------------------------------------------------------------
 // IO Ports API
 //----------------------------------------------------------------------------------------------------------------------
@@ -198,8 +418,35 @@ nxWord nxPeek16Ex(Next N, nxByte bank, nxWord p);
 #define NX_PORT_REG_SELECT      0x243b
 #define NX_PORT_REG_RW          0x253b
 
+// NEXT registers (accessed via nxWriteReg/nxReadReg)
+//
+//      $12     Layer 2 bank start
+//      $13     Layer 2 shadow bank start
+//      $14     Layer 2 transparency index
+//      $40     Palette index
+//      $41     Palette value as 8-bit RRRGGGBB (9th bit is B1|B0).  Increments the index.
+//      $43     Palette control
+//                  Bit 7:      Disable index auto-increment
+//                  Bits 6-4:   Palette read/written: 000 ULA, 001 Layer 2, 010 Sprites, 011 Tilemap (1xx = second)
+//                  Bit 3:      Sprites use the second palette
+//                  Bit 2:      Layer 2 uses the second palette
+//                  Bit 1:      ULA uses the second palette
+//      $44     Palette value as 9-bit.  First write is RRRGGGBB, second is P000000B, where P is the Layer 2 priority.
+//              Increments the index after the second write.
+//
+//  ULA palette entries 0-15 are the (bright) ink colours and entries 16-31 are the (bright) paper and border colours.
+//
+//      $50-$57 MMU: 8K page mapped into each 8K slot of the 64K, $0000-$1fff to $e000-$ffff.  Page n is the lower
+//              (n even) or upper (n odd) half of bank n/2.  Pages past the end of RAM (see NxConfig.ramSize; $ff, the
+//              ROM on the hardware, always is) read as $ff and ignore writes, so with 2MB the top half of bank 127 can
+//              only be reached with the Ex functions.  The default is 0, 1, 10, 11, 4, 5, 0, 1: banks 0, 5, 2 and 0,
+//              since the mock has no ROM.
+//
+
 // PAGING
 //
+// Selects the 16K bank in $c000-$ffff, by setting MMU slots 6 and 7 to its two 8K pages.
+//
 //          7   6   5   4   3   2   1   0
 //        +---+---+---+---+---+---+---+---+
 //  $7ffd |   |   |   |   |   | bits 0-2  |
@@ -241,16 +488,45 @@ NxData;
 
 
 // Load a file into memory and return a structure describing the data.  NxData.bytes will point to the buffer and
-// NxData.size will be the 64-bit length.  The file is open (shared for reading) until nxDataUnload is called.
+// NxData.size will be the 64-bit length.  The file is mapped read-only and paged in ahead of a sequential read, and
+// stays open (shared for reading) until nxDataUnload is called.  NxData.bytes is 0 if the file cannot be loaded or
+// is empty.
 NxData nxDataLoad(const char* fileName);
 
-// Unload a file and release the memory used.  The file is closed.
-void nxDataUnload(NxData d);
+// Unload a file and release the memory used.  The file is closed and the structure is cleared.
+void nxDataUnload(NxData* d);
 
 // Create a new file with the given size.  Write your data to the buffer described by NxData and call nxDataUnload
 // to write the file.
 NxData nxDataMake(const char* fileName, nxInt size);
 
+// Streams read a file through a window that is mapped a piece at a time, for files too big to map at once.  The
+// window slides forward as the cursor moves through the file, and the next window is read ahead once the cursor is
+// half way through the current one.
+typedef struct _NxStream* NxStream;
+
+// Open a file for streaming, mapping windowSize bytes at a time (rounded up to the OS's mapping granularity).  0
+// uses a 16MB window.  Returns 0 if the file cannot be opened.
+NxStream nxStreamOpen(const char* fileName, nxInt windowSize);
+
+// Close the stream and unmap its window.
+void nxStreamClose(NxStream S);
+
+// Return the length of the file, and the position of the cursor.
+nxInt nxStreamSize(NxStream S);
+nxInt nxStreamTell(NxStream S);
+
+// Move the cursor.  Returns NX_NO if the position is past the end of the file.
+nxBool nxStreamSeek(NxStream S, nxInt pos);
+
+// Copy up to size bytes from the cursor and move past them.  Returns the number of bytes copied, which is less than
+// size only at the end of the file.
+nxInt nxStreamRead(NxStream S, void* buffer, nxInt size);
+
+// Return a pointer to the size bytes at the cursor without copying them, and move past them.  The pointer is valid
+// until the next call on the stream.  Returns 0, without moving, if there are not that many bytes left.
+const nxByte* nxStreamNext(NxStream S, nxInt size);
+
 //----------------------------------------------------------------------------------------------------------------------
 // PNG/NIM routines
 // The PNG reading routines rely on stb_image.h.  The PNG writing routines will not.
@@ -289,6 +565,49 @@ nxBool nxNimWrite(const char* fileName, nxByte* img, nxWord width, nxWord height
 // Save a screenshot by writing out an uncompressed PNG file.
 //void nxScreenshot(Next N, const char* fileName);
 
+//----------------------------------------------------------------------------------------------------------------------
+// Asynchronous loading
+// These start reading a file on a background thread and return a handle straight away.  Once the file has been read,
+// its data is committed at the start of the next frame, before the frame routine is called, so a frame routine never
+// sees a load half done.  Poll the handle to find out when it has been committed, and free it when you are finished
+// with it.  Handles belong to the context: call these from the thread that calls nxUpdate, and don't use handles after
+// nxClose.
+//----------------------------------------------------------------------------------------------------------------------
+
+typedef struct _NxLoad* NxLoad;
+
+typedef enum
+{
+    NX_LOAD_PENDING,            // Still reading, or read but not committed yet
+    NX_LOAD_DONE,               // Committed
+    NX_LOAD_FAILED,             // The file could not be read, or did not fit
+}
+NxLoadState;
+
+// Asynchronous nxPokeFile.  The address is mapped with the paging in effect when the data is committed.
+NxLoad nxPokeFileAsync(Next N, nxWord address, const char* fileName);
+
+// Asynchronous nxNimRead.  Take the image with nxLoadImage once it is done.
+NxLoad nxNimReadAsync(Next N, const char* fileName);
+
+// Asynchronous nxPngRead.  The file is decoded on the background thread, and its colours are matched to the palette
+// in effect when it is committed.  Take the image with nxLoadImage once it is done.  Needs NX_USE_STB.
+NxLoad nxPngReadAsync(Next N, const char* fileName);
+
+// Return the state of a load without waiting.
+NxLoadState nxPoll(NxLoad L);
+
+// Wait until the file has been read, commit it now if it hasn't been already, and return the final state.
+NxLoadState nxWait(NxLoad L);
+
+// Take the image of a finished nxNimReadAsync or nxPngReadAsync, which you then free with nxNimFree or nxPngFree.
+// Returns 0 if the load has not finished, failed, or its image has already been taken.
+nxByte* nxLoadImage(NxLoad L, nxWord* width, nxWord* height);
+
+// Release a handle.  A load that is still pending is not cancelled: a poke is still committed, and an image that
+// can no longer be taken is thrown away.
+void nxLoadFree(NxLoad L);
+
 //----------------------------------------------------------------------------------------------------------------------
 // Convenience macros
 // Used internally but exposed for their value.
@@ -305,14 +624,59 @@ nxBool nxNimWrite(const char* fileName, nxByte* img, nxWord width, nxWord height
 #ifdef NX_IMPLEMENTATION
 
 #include <assert.h>
-#include <conio.h>
 #include <fcntl.h>
-#include <io.h>
 #include <memory.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
 
+#ifdef _WIN32
+#   define WIN32_LEAN_AND_MEAN
+#   include <Windows.h>
+#   include <conio.h>
+#   include <io.h>
+#else
+#   include <errno.h>
+#   include <pthread.h>
+#   include <unistd.h>
+#   include <sys/mman.h>
+#   include <sys/stat.h>
+#endif
+
+// Window backend.  Without one, every context is headless.
+#if defined(_WIN32) && !defined(NX_HEADLESS)
+#   define NX_WINDOW_WIN32 1
+#elif defined(NX_USE_X11) && !defined(NX_HEADLESS)
+#   define NX_WINDOW_X11 1
+#   include <X11/Xlib.h>
+#   include <X11/Xutil.h>
+#   include <X11/keysym.h>
+#   include <X11/extensions/XShm.h>
+#   include <poll.h>
+#   include <sys/ipc.h>
+#   include <sys/shm.h>
+#   ifdef __linux__
+#       include <sys/timerfd.h>
+#   endif
+#endif
+
+#if !defined(NX_NO_SIMD) && (defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__))
+#   define NX_SIMD_X86 1
+#   include <immintrin.h>
+#   ifdef _MSC_VER
+#       include <intrin.h>
+#   endif
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#   define NX_TARGET_SSE2 __attribute__((target("sse2")))
+#   define NX_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#   define NX_TARGET_SSE2
+#   define NX_TARGET_AVX2
+#endif
+
 #define NxInternal static
 #define NX_ASSERT(x, ...) assert(x)
 
@@ -412,7 +776,8 @@ NxInternal void nxMemoryClear(void* mem, nxInt numBytes)
 #define __nxArrayMayGrow(a, n) (__nxArrayNeedsToGrow(a, (n)) ? __nxArrayGrow(a, n) : 0)
 #define __nxArrayGrow(a, n) ((a) = __nxArrayInternalGrow((a), (n), sizeof(*(a))))
 
-NxInternal void* __nxArrayInternalGrow(void* a, nxInt increment, nxInt elemSize)
+// Inline so builds where nothing uses an array, like headless ones, don't warn that it is unused.
+NxInternal inline void* __nxArrayInternalGrow(void* a, nxInt increment, nxInt elemSize)
 {
     nxInt doubleCurrent = a ? 2 * __nxArrayCapacity(a) : 0;
     nxInt minNeeded = nxArrayCount(a) + increment;
@@ -482,7 +847,7 @@ NxInternal void* nxArenaAlloc(NxArena* A, nxInt numBytes)
         nxInt requiredSize = A->cursor + numBytes;
         nxInt newSize = currentSize + NX_MAX(requiredSize, NX_ARENA_INCREMENT);
 
-        nxByte* newArena = (nxByte *)NX_REALLOC(A, currentSize, newSize);
+        nxByte* newArena = (nxByte *)NX_REALLOC(A->start, currentSize, newSize);
 
         if (newArena)
         {
@@ -501,47 +866,432 @@ NxInternal void* nxArenaAlloc(NxArena* A, nxInt numBytes)
 }
 
 //----------------------------------------------------------------------------------------------------------------------
-// Global variables (YES I KNOW!) and constants
+// Threads
+// Thin wrappers around the OS threads, locks, condition variables and one-time initialisation, and a pool of worker
+// threads that run the same job over a range of indices.
 //----------------------------------------------------------------------------------------------------------------------
 
-int gArgc = 0;
-char** gArgv = 0;
+typedef void(*NxThreadFunc)(void* data);
+
+typedef struct
+{
+    NxThreadFunc        func;
+    void*               data;
+#ifdef _WIN32
+    HANDLE              handle;
+#else
+    pthread_t           handle;
+#endif
+}
+NxThread;
+
+#ifdef _WIN32
+
+typedef SRWLOCK NxMutex;
+typedef CONDITION_VARIABLE NxCond;
+typedef volatile LONG NxAtomic;
+typedef INIT_ONCE NxOnce;
+
+#define NX_MUTEX_INIT   SRWLOCK_INIT
+#define NX_ONCE_INIT    INIT_ONCE_STATIC_INIT
+
+NxInternal DWORD WINAPI nxThreadEntry(LPVOID data)
+{
+    NxThread* T = (NxThread *)data;
+    T->func(T->data);
+    return 0;
+}
+
+NxInternal nxBool nxThreadStart(NxThread* T, NxThreadFunc func, void* data)
+{
+    T->func = func;
+    T->data = data;
+    T->handle = CreateThread(0, 0, &nxThreadEntry, T, 0, 0);
+    return NX_AS_BOOL(T->handle);
+}
+
+NxInternal void nxThreadJoin(NxThread* T)
+{
+    WaitForSingleObject(T->handle, INFINITE);
+    CloseHandle(T->handle);
+}
+
+NxInternal void nxMutexInit(NxMutex* M)      { InitializeSRWLock(M); }
+NxInternal void nxMutexDone(NxMutex* M)      { }
+NxInternal void nxMutexLock(NxMutex* M)      { AcquireSRWLockExclusive(M); }
+NxInternal void nxMutexUnlock(NxMutex* M)    { ReleaseSRWLockExclusive(M); }
+
+NxInternal void nxCondInit(NxCond* C)                   { InitializeConditionVariable(C); }
+NxInternal void nxCondDone(NxCond* C)                   { }
+NxInternal void nxCondWait(NxCond* C, NxMutex* M)       { SleepConditionVariableSRW(C, M, INFINITE, 0); }
+NxInternal void nxCondSignal(NxCond* C)                 { WakeConditionVariable(C); }
+NxInternal void nxCondBroadcast(NxCond* C)              { WakeAllConditionVariable(C); }
+
+// Returns the incremented value
+NxInternal int nxAtomicInc(NxAtomic* a)                 { return (int)InterlockedIncrement(a); }
+
+// Returns the decremented value
+NxInternal int nxAtomicDec(NxAtomic* a)                 { return (int)InterlockedDecrement(a); }
+NxInternal int nxAtomicGet(NxAtomic* a)                 { return (int)InterlockedCompareExchange(a, 0, 0); }
+
+NxInternal BOOL CALLBACK nxOnceEntry(PINIT_ONCE once, PVOID func, PVOID* context)
+{
+    ((void(*)(void))func)();
+    return TRUE;
+}
+
+// Call func the first time this is called with once, however many threads get here at the same time.  The others
+// wait for it to return.
+NxInternal void nxOnce(NxOnce* once, void(*func)(void))   { InitOnceExecuteOnce(once, &nxOnceEntry, (PVOID)func, 0); }
+
+// Number of logical processors.
+NxInternal int nxCpuCount()
+{
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+}
+
+#else
+
+typedef pthread_mutex_t NxMutex;
+typedef pthread_cond_t NxCond;
+typedef volatile long NxAtomic;
+typedef pthread_once_t NxOnce;
+
+#define NX_MUTEX_INIT   PTHREAD_MUTEX_INITIALIZER
+#define NX_ONCE_INIT    PTHREAD_ONCE_INIT
+
+NxInternal void* nxThreadEntry(void* data)
+{
+    NxThread* T = (NxThread *)data;
+    T->func(T->data);
+    return 0;
+}
+
+NxInternal nxBool nxThreadStart(NxThread* T, NxThreadFunc func, void* data)
+{
+    T->func = func;
+    T->data = data;
+    return NX_AS_BOOL(pthread_create(&T->handle, 0, &nxThreadEntry, T) == 0);
+}
+
+NxInternal void nxThreadJoin(NxThread* T)
+{
+    pthread_join(T->handle, 0);
+}
+
+NxInternal void nxMutexInit(NxMutex* M)      { pthread_mutex_init(M, 0); }
+NxInternal void nxMutexDone(NxMutex* M)      { pthread_mutex_destroy(M); }
+NxInternal void nxMutexLock(NxMutex* M)      { pthread_mutex_lock(M); }
+NxInternal void nxMutexUnlock(NxMutex* M)    { pthread_mutex_unlock(M); }
+
+NxInternal void nxCondInit(NxCond* C)                   { pthread_cond_init(C, 0); }
+NxInternal void nxCondDone(NxCond* C)                   { pthread_cond_destroy(C); }
+NxInternal void nxCondWait(NxCond* C, NxMutex* M)       { pthread_cond_wait(C, M); }
+NxInternal void nxCondSignal(NxCond* C)                 { pthread_cond_signal(C); }
+NxInternal void nxCondBroadcast(NxCond* C)              { pthread_cond_broadcast(C); }
+
+// Returns the incremented value
+NxInternal int nxAtomicInc(NxAtomic* a)                 { return (int)__sync_add_and_fetch(a, 1); }
+
+// Returns the decremented value
+NxInternal int nxAtomicDec(NxAtomic* a)                 { return (int)__sync_sub_and_fetch(a, 1); }
+NxInternal int nxAtomicGet(NxAtomic* a)                 { return (int)__sync_fetch_and_add(a, 0); }
+
+// Call func the first time this is called with once, however many threads get here at the same time.  The others
+// wait for it to return.
+NxInternal void nxOnce(NxOnce* once, void(*func)(void))   { pthread_once(once, func); }
+
+// Number of logical processors.
+NxInternal int nxCpuCount()
+{
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (int)count : 1;
+}
+
+#endif // _WIN32
+
+//
+// Worker pool
+//
+// nxPoolRun(P, func, data, count) calls func(data, i) for i = 0..count-1 across the workers and the calling thread,
+// and returns when all calls have finished.  The workers sleep between jobs.
+//
+
+typedef void(*NxJobFunc)(void* data, int index);
+
+typedef struct
+{
+    NxThread*           threads;
+    int                 numThreads;
+    NxMutex             lock;
+    NxCond              wake;           // Signalled when a new job is posted or the pool closes
+    NxCond              done;           // Signalled when the last worker finishes a job
+    nxDword             generation;     // Incremented for each job
+    int                 busy;           // Number of workers still on the current job
+    nxBool              quit;
+
+    // Current job
+    NxJobFunc           func;
+    void*               data;
+    int                 count;
+    NxAtomic            next;           // Next index to run, minus one
+}
+NxPool;
+
+NxInternal void nxPoolWork(NxPool* P)
+{
+    int i;
+    while ((i = nxAtomicInc(&P->next) - 1) < P->count)
+    {
+        P->func(P->data, i);
+    }
+}
+
+NxInternal void nxPoolWorker(void* data)
+{
+    NxPool* P = (NxPool *)data;
+    nxDword generation = 0;
+
+    nxMutexLock(&P->lock);
+    for (;;)
+    {
+        while (!P->quit && P->generation == generation) nxCondWait(&P->wake, &P->lock);
+        if (P->quit) break;
+        generation = P->generation;
+        nxMutexUnlock(&P->lock);
+
+        nxPoolWork(P);
+
+        nxMutexLock(&P->lock);
+        if (--P->busy == 0) nxCondSignal(&P->done);
+    }
+    nxMutexUnlock(&P->lock);
+}
+
+// Create a pool with numWorkers threads (on top of the calling thread).
+NxInternal NxPool* nxPoolOpen(int numWorkers)
+{
+    NxPool* P = (NxPool *)NX_ALLOC(sizeof(NxPool));
+    nxMemoryClear(P, sizeof(NxPool));
+    nxMutexInit(&P->lock);
+    nxCondInit(&P->wake);
+    nxCondInit(&P->done);
+
+    P->threads = (NxThread *)NX_ALLOC(sizeof(NxThread) * NX_MAX(numWorkers, 1));
+    for (int i = 0; i < numWorkers; ++i)
+    {
+        if (!nxThreadStart(&P->threads[P->numThreads], &nxPoolWorker, P)) break;
+        ++P->numThreads;
+    }
+
+    return P;
+}
+
+NxInternal void nxPoolClose(NxPool* P)
+{
+    if (!P) return;
+
+    nxMutexLock(&P->lock);
+    P->quit = NX_YES;
+    nxCondBroadcast(&P->wake);
+    nxMutexUnlock(&P->lock);
+
+    for (int i = 0; i < P->numThreads; ++i) nxThreadJoin(&P->threads[i]);
+
+    NX_FREE(P->threads);
+    nxCondDone(&P->done);
+    nxCondDone(&P->wake);
+    nxMutexDone(&P->lock);
+    NX_FREE(P);
+}
+
+NxInternal void nxPoolRun(NxPool* P, NxJobFunc func, void* data, int count)
+{
+    nxMutexLock(&P->lock);
+    P->func = func;
+    P->data = data;
+    P->count = count;
+    P->next = 0;
+    P->busy = P->numThreads;
+    ++P->generation;
+    nxCondBroadcast(&P->wake);
+    nxMutexUnlock(&P->lock);
+
+    nxPoolWork(P);
+
+    nxMutexLock(&P->lock);
+    while (P->busy) nxCondWait(&P->done, &P->lock);
+    nxMutexUnlock(&P->lock);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Global variables (YES I KNOW!) and constants
+//----------------------------------------------------------------------------------------------------------------------
 
 typedef struct _WindowInfo WindowInfo;
-typedef int Window;
+typedef int NxWindow;
 
-NxArray(WindowInfo) gWindows = 0;
+#if NX_WINDOW_WIN32 || NX_WINDOW_X11
+
+// Windows share the process's connection to the window system, so all windowed contexts are driven from one thread.
+// Only that thread adds to gWindows, and it reads the table directly.  Each WindowInfo is allocated on its own so it
+// never moves, and other threads (the render thread) look it up with nxWindowInfo, which holds gWindowLock against
+// the table growing.
+NxArray(WindowInfo*) gWindows = 0;
+NxMutex gWindowLock = NX_MUTEX_INIT;
 int gWindowRefCount = 0;
 
+NxInternal WindowInfo* nxWindowInfo(NxWindow window)
+{
+    nxMutexLock(&gWindowLock);
+    WindowInfo* info = gWindows[window];
+    nxMutexUnlock(&gWindowLock);
+    return info;
+}
+
+// Add a zeroed window to the table and return its handle.
+NxInternal NxWindow nxWindowAdd(nxInt infoSize)
+{
+    WindowInfo* info = (WindowInfo *)NX_ALLOC(infoSize);
+    nxMemoryClear(info, infoSize);
+
+    nxMutexLock(&gWindowLock);
+    nxArrayAdd(gWindows, info);
+    NxWindow window = (NxWindow)(nxArrayCount(gWindows) - 1);
+    nxMutexUnlock(&gWindowLock);
+
+    return window;
+}
+
+#endif // NX_WINDOW_WIN32 || NX_WINDOW_X11
+
 #define NX_SCREEN_WIDTH     256
 #define NX_SCREEN_HEIGHT    192
 #define NX_WINDOW_WIDTH     320
 #define NX_WINDOW_HEIGHT    256
 #define NX_BORDER_WIDTH     ((NX_WINDOW_WIDTH - NX_SCREEN_WIDTH) / 2)
 #define NX_BORDER_HEIGHT    ((NX_WINDOW_HEIGHT - NX_SCREEN_HEIGHT) / 2)
-#define NX_NUM_PAGES        40
+#define NX_CELL_COLUMNS     (NX_SCREEN_WIDTH / 8)
+#define NX_CELL_ROWS        (NX_SCREEN_HEIGHT / 8)
+#define NX_MAX_BANKS        128                     // 2MB
+#define NX_DEFAULT_RAM_SIZE 1024
+
+//----------------------------------------------------------------------------------------------------------------------
+// Palettes
+//
+// The Next has 8 palettes of 256 9-bit colours: a first and second palette for each of the ULA, Layer 2, sprites and
+// the tilemap.  Register 0x43 selects which one is written through registers 0x41/0x44, and which of each pair is used
+// for display.  Every palette keeps ARGB and RGB888 copies of its colours which are rebuilt on demand when its version
+// number changes.
+//----------------------------------------------------------------------------------------------------------------------
+
+#define NX_PALETTE_ULA          0
+#define NX_PALETTE_LAYER2       1
+#define NX_PALETTE_SPRITES      2
+#define NX_PALETTE_TILEMAP      3
+#define NX_PALETTE_SECOND       4       // Add to the above to get the second palette
+#define NX_NUM_PALETTES         8
+
+#define NX_PALETTE_PRIORITY     0x8000  // Layer 2 priority bit, kept above the 9-bit colour
+
+typedef struct
+{
+    nxWord              colours[256];               // RRRGGGBBB colours, with NX_PALETTE_PRIORITY
+    nxDword             version;                    // Incremented every time a colour changes
+
+    // Caches, valid when cacheVersion == version
+    nxDword             cacheVersion;
+    nxDword             argb[256];
+    nxByte              rgb[256][3];
+}
+NxPalette;
+
+// A 16K bank of RAM, shared between a context and its snapshots.  Only a context that holds the only reference may
+// write to it.
+typedef struct
+{
+    NxAtomic            refs;
+    nxByte              mem[16384];
+}
+NxBank;
 
 struct _Next
 {
-    Window              window;
+    NxWindow            window;                     // -1 if headless
+    nxBool              headless;
+    nxBool              redrawPending;              // Headless only: nxRedraw has been called since the last render
     nxDword*            image;
 
     // Memory
-    nxByte              banks[4];
-    nxByte              pages[NX_NUM_PAGES][16384];
-    nxByte              palette[256];
+    NxBank*             banks[NX_MAX_BANKS];        // 16K banks of RAM, 0 until they are first written
+    int                 numBanks;
+    nxByte              mmu[8];                     // Registers 0x50-0x57: 8K page in each 8K slot
+    nxByte*             readMap[8];                 // Memory read and written through each slot, from mmu and the
+    nxByte*             writeMap[8];                //   Layer 2 write mapping.  Rebuilt by nxMmuUpdate.  Slots of
+                                                    //   banks not written yet read kZeroBank, and slots of banks
+                                                    //   not written yet or shared with a snapshot write through 0.
+    nxByte              readBank[8];                // Bank and offset into it of each slot, for marking dirty cells.
+    nxByte              writeBank[8];               //   0xff if the slot is unmapped.
+    nxWord              readBase[8];
+    nxWord              writeBase[8];
+    nxByte              unmappedRead[8192];         // Read through unmapped slots: all 0xff
+    nxByte              unmappedWrite[8192];        // Written through unmapped slots, and never read
+    nxQword             writtenBlocks[256];         // Bit n of a bank is set if $n00-$nff has been written since
+                                                    //   nxDirtyClear.  Unmapped writes set bank 0xff's, which
+                                                    //   nxDirtyQuery never returns.
+    // Palettes
+    NxPalette           palettes[NX_NUM_PALETTES];
+    nxByte              paletteIndex;               // Register 0x40
+    nxByte              paletteControl;             // Register 0x43
+    nxBool              paletteSecondWrite;         // Next write to register 0x44 is the 2nd byte
+    nxByte              paletteFirstByte;           // 1st byte written to register 0x44
     nxByte              page0_2;
     nxByte              page3_5;
 
     // Timings
-    clock_t             lastTimeStamp;  // Used to measure time passing
+    nxFloat             lastTimeStamp;  // Used to measure time passing (monotonic clock, in seconds)
     nxFloat             currentTime;    // Used to know when interrupt is passing
+    nxBool              framePacing;
+    nxBool              turbo;
+    nxBool              batch;          // Inside nxRunFrames
+    int                 renderInterval;
+    int                 renderCount;    // Frames run back to back since one was shown
+    int                 maxCatchUp;
+    nxBool              catchUpSkipRender;
+    void*               sleepTimer;     // Windows waitable timer used to wait for the next frame
+    int                 timerFd;        // Linux timerfd used to wait for the next frame with X11, or -1
+    NxStats             stats;
     int                 flashCount;
     nxBool              flash;
 
     // IO state
     nxByte              border;
 
+    // Options
+    NxRenderMode        renderMode;
+    NxRenderPath        renderPath;
+    int                 renderThreads;
+    NxPool*             renderPool;                 // Workers for banded rendering, 0 if rendering on one thread
+    int                 scale;
+    nxDword*            scaled;                     // Image zoomed by scale, allocated when first needed
+    struct _NxPresenter* presenter;                 // Render thread in NX_RENDER_MODE_THREADED, otherwise 0
+    struct _NxLoader*   loader;                     // Asynchronous loading thread, started by the first async load
+    NxLoad              loads;                      // Async loads not yet committed, or not yet freed, oldest first
+    int                 fleetIndex;                 // Index in the context's fleet, or -1
+    nxBool              fleetStop;                  // nxFleetStop has been called during this nxFleetRun
+
+    // Render state
+    nxDword             ulaInk[2][256];             // Ink and paper colours for each attribute, indexed by flash
+    nxDword             ulaPaper[2][256];
+    const NxPalette*    ulaColoursPalette;          // Palette and version that ulaInk and ulaPaper were built from
+    nxDword             ulaColoursVersion;
+    nxDword             dirtyCells[NX_CELL_ROWS];   // Bit n of row y is set if the 8x8 cell (n, y) must be re-rendered
+    nxBool              dirtyBorder;                // Border colour has changed since the last render
+    nxDword             flashCells[NX_CELL_ROWS];   // Bit n of row y is set if the attribute of cell (n, y) flashes
+    int                 scanline;                   // Next image line to render in NX_RENDER_MODE_SCANLINE
+
     // Layer-2 state
     nxByte              layer2Bank;                 // Sub bank (0-2) of layer
     nxByte              layer2BankStart;            // Start bank for layer 2 VRAM
@@ -559,516 +1309,3067 @@ struct _Next
 // Rendering
 //----------------------------------------------------------------------------------------------------------------------
 
-NxInternal void nxRenderULA(Next N)
+static const nxDword kColour_3bit[] = { 0, 36, 73, 109, 146, 182, 219, 255 };
+
+// Default ULA colours (8-bit RRRGGGBB): ink, bright ink, paper, bright paper.
+static const nxByte kUlaDefaultColours[16] =
 {
-    static const nxDword colours[16] =
-    {
-        0x000000, 0x0000d7, 0xd70000, 0xd700d7, 0x00d700, 0x00d7d7, 0xd7d700, 0xd7d7d7,
-        0x000000, 0x0000ff, 0xff0000, 0xff00ff, 0x00ff00, 0x00ffff, 0xffff00, 0xffffff,
-    };
+    0x00, 0x02, 0xa0, 0xa2, 0x14, 0x16, 0xb4, 0xb6,
+    0x00, 0x03, 0xe0, 0xe7, 0x1c, 0x1f, 0xfc, 0xff,
+};
 
-    nxDword* img = N->image;
-    int border = 7;
+// Convert a 9-bit RRRGGGBBB colour to 0xAARRGGBB.
+NxInternal nxDword nxColourToArgb(nxWord colour)
+{
+    return (nxDword)0xff000000 +
+           (kColour_3bit[(colour >> 6) & 7] << 16) +
+           (kColour_3bit[(colour >> 3) & 7] << 8) +
+           kColour_3bit[colour & 7];
+}
 
-    for (int r = -NX_BORDER_HEIGHT; r < (NX_SCREEN_HEIGHT + NX_BORDER_HEIGHT); ++r)
-    {
-        if (r < 0 || r >= NX_SCREEN_HEIGHT)
-        {
-            for (int c = -NX_BORDER_WIDTH; c < (NX_SCREEN_WIDTH + NX_BORDER_WIDTH); ++c)
-            {
-                *img++ = colours[N->border & 0x7];
-            }
-        }
-        else
-        {
-            // Video data.
-            //  Pixels address is 010S SRRR CCCX XXXX
-            //  Attrs address is 0101 10YY YYYX XXXX
-            //  S = Section (0-2)
-            //  C = Cell row within section (0-7)
-            //  R = Pixel row within cell (0-7)
-            //  X = X coord (0-31)
-            //  Y = Y coord (0-23)
-            //
-            //  ROW = SSCC CRRR
-            //      = YYYY Y000
-            nxByte bank = 5;
-            nxWord p = ((r & 0x0c0) << 5) + ((r & 0x7) << 8) + ((r & 0x38) << 2);
-            nxWord a = 0x1800 + ((r & 0xf8) << 2);
-
-            for (int c = -NX_BORDER_WIDTH; c < (NX_SCREEN_WIDTH + NX_BORDER_WIDTH); ++c)
-            {
-                if (c < 0 || c >= NX_SCREEN_WIDTH)
-                {
-                    *img++ = colours[N->border & 0x7];
-                }
-                else
-                {
-                    nxByte data = nxPeekEx(N, bank, p++);
-                    nxByte attr = nxPeekEx(N, bank, a++);
-                    nxDword ink = colours[(attr & 7) + ((attr & 0x40) >> 3)];
-                    nxDword paper = colours[(attr & 0x7f) >> 3];
-                    nxBool flash = NX_AS_BOOL(attr & 0x80);
+// Convert an 8-bit RRRGGGBB colour to 9-bit.  The extra blue bit is the OR of the other two, like the hardware.
+NxInternal nxWord nxColourFrom8Bit(nxByte colour)
+{
+    return (nxWord)((colour << 1) | ((colour | (colour >> 1)) & 1));
+}
 
-                    if (flash && N->flash)
-                    {
-                        nxDword t = ink;
-                        ink = paper;
-                        paper = t;
-                    }
+NxInternal void nxPaletteSet(NxPalette* P, nxByte index, nxWord colour)
+{
+    P->colours[index] = colour;
+    ++P->version;
+}
 
-                    for (int i = 7; i >= 0; --i)
-                    {
-                        img[i] = (data & 1) ? ink : paper;
-                        data >>= 1;
-                    }
-                    img += 8;
-                    c += 7;  // for loop with increment it once more
-                }
-            }
+// Return the palette with its caches up to date.
+NxInternal const NxPalette* nxPaletteCache(NxPalette* P)
+{
+    if (P->cacheVersion != P->version)
+    {
+        for (int i = 0; i < 256; ++i)
+        {
+            nxWord c = P->colours[i];
+            P->argb[i] = nxColourToArgb(c);
+            P->rgb[i][0] = (nxByte)kColour_3bit[(c >> 6) & 7];
+            P->rgb[i][1] = (nxByte)kColour_3bit[(c >> 3) & 7];
+            P->rgb[i][2] = (nxByte)kColour_3bit[c & 7];
         }
+        P->cacheVersion = P->version;
     }
-}
 
-static nxDword kColour_3bit[] = { 0, 36, 73, 109, 146, 182, 219, 255 };
-static nxDword kColour_2bit[] = { 0, 85, 170, 255 };
+    return P;
+}
 
-NxInternal nxDword nxConvertNextLayer2Pixel(Next N, nxByte pixel)
+// Return the palette currently displayed for a layer (NX_PALETTE_ULA, NX_PALETTE_LAYER2...).
+NxInternal NxPalette* nxActivePalette(Next N, int layer)
 {
-    pixel = N->palette[pixel];
-    nxDword r = (nxDword)((pixel & 0xe0) >> 5);
-    nxDword g = (nxDword)((pixel & 0x1c) >> 2);
-    nxDword b = (nxDword)(pixel & 0x03);
-    return (nxDword)0xff000000 + (kColour_3bit[r] << 16) + (kColour_3bit[g] << 8) + kColour_2bit[b];
+    // Register 0x43: bit 1 = ULA, bit 2 = Layer 2, bit 3 = sprites use the second palette
+    static const nxByte kSecondBits[4] = { 0x02, 0x04, 0x08, 0x00 };
+    return &N->palettes[layer + ((N->paletteControl & kSecondBits[layer]) ? NX_PALETTE_SECOND : 0)];
 }
 
-void nxRenderLayer2(Next N)
+NxInternal void nxPaletteReset(Next N)
 {
-    nxDword* img = N->image + NX_BORDER_WIDTH + (NX_BORDER_HEIGHT * NX_WINDOW_WIDTH);
-    nxByte bank = N->layer2ShadowEnable ? N->layer2ShadowBankStart : N->layer2BankStart;
-
-    for (int b = 0; b < 3; ++b)
+    for (int p = 0; p < NX_NUM_PALETTES; ++p)
     {
-        nxWord address = 0;
-        for (int row = 0; row < 64; ++row)
+        NxPalette* P = &N->palettes[p];
+        for (int i = 0; i < 256; ++i)
+        {
+            P->colours[i] = nxColourFrom8Bit((nxByte)i);
+        }
+
+        if ((p & ~NX_PALETTE_SECOND) == NX_PALETTE_ULA)
         {
-            for (int col = 0; col < 256; ++col)
+            for (int i = 0; i < 16; ++i)
             {
-                nxByte pixel = nxPeekEx(N, bank + b, address++);
-                if (pixel != N->layer2Transparent)
-                {
-                    img[col] = nxConvertNextLayer2Pixel(N, pixel);
-                }
+                P->colours[i] = P->colours[i + 16] = nxColourFrom8Bit(kUlaDefaultColours[i]);
             }
-            img += NX_WINDOW_WIDTH;
         }
-    }
-}
 
-NxInternal void nxRender(Next N)
-{
-    nxRenderULA(N);
-    if (N->layer2Enable)
-    {
-        nxRenderLayer2(N);
+        P->version = 1;
+        P->cacheVersion = 0;
     }
-}
 
-//----------------------------------------------------------------------------------------------------------------------
-// Windows operations
-//----------------------------------------------------------------------------------------------------------------------
+    N->paletteIndex = 0;
+    N->paletteControl = 0;
+    N->paletteSecondWrite = NX_NO;
+    N->paletteFirstByte = 0;
+}
 
-#ifdef _WIN32
+//
+// Memory banks
+//
+// Banks are allocated the first time they are written, so a context only uses host memory for the RAM it touches.
+// Until then they read as zero from one bank shared by every context, which is never written.  Banks are reference
+// counted so snapshots can share them, and a shared bank is copied before it is written.
+//
 
-#define WIN32_LEAN_AND_MEAN
-#include <Windows.h>
+static const nxByte kZeroBank[16384] = { 0 };
 
-struct _WindowInfo
+// Drop a reference to a bank, freeing it if it was the last.
+NxInternal void nxBankRelease(NxBank* B)
 {
-    Next            N;
-    HWND            handle;
-    BITMAPINFO      info;
-    int             imageWidth;
-    int             imageHeight;
-    int             windowWidth;
-    int             windowHeight;
-};
+    if (B && nxAtomicDec(&B->refs) == 0) NX_FREE(B);
+}
 
-ATOM gWindowClassAtom = 0;
+// Return a bank for reading.  Banks past the end of RAM read as zero.
+NxInternal const nxByte* nxBankRead(Next N, int bank)
+{
+    return (bank < N->numBanks && N->banks[bank]) ? N->banks[bank]->mem : kZeroBank;
+}
 
-NxInternal Window nxWin32AllocHandle()
+// Return a bank for writing, allocating it if it hasn't been written before, or copying it if a snapshot shares it.
+// Returns 0 if it is past the end of RAM.
+NxInternal nxByte* nxBankWrite(Next N, int bank)
 {
-    for (int i = 0; i < nxArrayCount(gWindows); ++i)
+    if (bank >= N->numBanks) return 0;
+
+    NxBank* B = N->banks[bank];
+    if (!B || nxAtomicGet(&B->refs) > 1)
     {
-        if (gWindows[i].handle == 0) return i;
+        NxBank* copy = (NxBank *)NX_ALLOC(sizeof(NxBank));
+        copy->refs = 1;
+        if (B)
+        {
+            nxMemoryCopy(B->mem, copy->mem, sizeof(copy->mem));
+            nxBankRelease(B);
+        }
+        else
+        {
+            nxMemoryClear(copy->mem, sizeof(copy->mem));
+        }
+        N->banks[bank] = copy;
+        ++N->stats.committedBanks;
+
+        // Point the slots that map it at the new memory
+        for (int slot = 0; slot < 8; ++slot)
+        {
+            if (N->readBank[slot] == bank) N->readMap[slot] = copy->mem + N->readBase[slot];
+            if (N->writeBank[slot] == bank) N->writeMap[slot] = copy->mem + N->writeBase[slot];
+        }
     }
 
-    gWindows = nxArrayExpand(gWindows, 1);
-    return (Window)(nxArrayCount(gWindows) - 1);
+    return N->banks[bank]->mem;
 }
 
-NxInternal Window nxWin32FindHandle(HWND wnd)
+// Return the memory written through a slot, making its bank writable first if it isn't.
+NxInternal nxByte* nxSlotWrite(Next N, int slot)
 {
-    nxInt count = nxArrayCount(gWindows);
-    for (int i = 0; i < count; ++i)
-    {
-        if (gWindows[i].handle == wnd) return i;
-    }
-
-    return -1;
+    if (!N->writeMap[slot]) N->writeMap[slot] = nxBankWrite(N, N->writeBank[slot]) + N->writeBase[slot];
+    return N->writeMap[slot];
 }
 
-typedef struct WindowCreateInfo
+// Mark every cell on the screen to be re-rendered.
+NxInternal void nxDirtyScreen(Next N)
 {
-    Window handle;
+    for (int y = 0; y < NX_CELL_ROWS; ++y) N->dirtyCells[y] = 0xffffffff;
 }
-WindowCreateInfo;
 
-void nxWin32Lock();
-void nxWin32Unlock();
-void nxWin32CloseWindow(Window window);
-Window nxWin32MakeWindow(const char* title, Next N, int scale);
+// Mark every cell and the border to be re-rendered.
+NxInternal void nxDirtyAll(Next N)
+{
+    nxDirtyScreen(N);
+    N->dirtyBorder = NX_YES;
+}
 
-NxInternal LRESULT CALLBACK nxWin32WindowProc(HWND wnd, UINT msg, WPARAM w, LPARAM l)
+// Mark the cells with flashing attributes to be re-rendered.  Returns NX_YES if there are any.
+NxInternal nxBool nxDirtyFlash(Next N)
 {
-    if (msg == WM_CREATE)
+    nxDword cells = 0;
+    for (int y = 0; y < NX_CELL_ROWS; ++y)
     {
-        CREATESTRUCTA* cs = (CREATESTRUCTA *)l;
-        WindowCreateInfo* wci = (WindowCreateInfo *)cs->lpCreateParams;
-        gWindows[wci->handle].handle = wnd;
+        N->dirtyCells[y] |= N->flashCells[y];
+        cells |= N->flashCells[y];
     }
-    else
-    {
-        Window window = nxWin32FindHandle(wnd);
-        WindowInfo* info = (window == -1 ? 0 : &gWindows[window]);
+    return NX_AS_BOOL(cells);
+}
 
-        switch (msg)
+// Rebuild the flashing cells from the attributes in bank 5.
+NxInternal void nxFlashRebuild(Next N)
+{
+    const nxByte* attrs = nxBankRead(N, 5) + 0x1800;
+    for (int y = 0; y < NX_CELL_ROWS; ++y)
+    {
+        nxDword cells = 0;
+        for (int x = 0; x < NX_CELL_COLUMNS; ++x)
         {
-        case WM_SIZE:
-            if (info)
-            {
-                int bitmapMemorySize = 0;
-
-                info->windowWidth = LOWORD(l);
-                info->windowHeight = HIWORD(l);
-
-                ZeroMemory(&info->info.bmiHeader, sizeof(info->info.bmiHeader));
-
-                info->info.bmiHeader.biSize = sizeof(info->info.bmiHeader);
-                info->info.bmiHeader.biWidth = info->imageWidth;
-                info->info.bmiHeader.biHeight = -info->imageHeight;
-                info->info.bmiHeader.biPlanes = 1;
-                info->info.bmiHeader.biBitCount = 32;
-                info->info.bmiHeader.biClrImportant = BI_RGB;
-            }
-            break;
-
-        case WM_PAINT:
-            if (info)
-            {
-                nxRender(info->N);
-                PAINTSTRUCT ps;
-                HDC dc = BeginPaint(wnd, &ps);
-                StretchDIBits(dc,
-                    0, 0, info->windowWidth, info->windowHeight,
-                    0, 0, info->imageWidth, info->imageHeight,
-                    info->N->image, &info->info,
-                    DIB_RGB_COLORS, SRCCOPY);
-                EndPaint(wnd, &ps);
-            }
-            break;
+            if (attrs[y * NX_CELL_COLUMNS + x] & 0x80) cells |= (nxDword)1 << x;
+        }
+        N->flashCells[y] = cells;
+    }
+}
 
-        case WM_CLOSE:
-            DestroyWindow(wnd);
-            break;
+// Mark the cells affected by a write to a bank, after the byte has been written, and record the block it was in.
+// Attribute writes also keep the flashing cells up to date.  Returns NX_YES if the write is visible.
+NxInternal nxBool nxDirtyWrite(Next N, nxByte bank, nxWord p)
+{
+    nxBool visible = NX_NO;
+    N->writtenBlocks[bank] |= (nxQword)1 << (p >> 8);
 
-        case WM_DESTROY:
-            if (--gWindowRefCount == 0)
+    if (bank == 5)
+    {
+        if (p < 0x1800)
+        {
+            // Pixels: 0SSR RRCC CXXX XX -> cell row is SSCCC
+            N->dirtyCells[((p >> 8) & 0x18) | ((p >> 5) & 0x07)] |= (nxDword)1 << (p & 0x1f);
+            visible = NX_YES;
+        }
+        else if (p < 0x1b00)
+        {
+            // Attributes: 0110 YYYY YXXX XX
+            nxDword bit = (nxDword)1 << (p & 0x1f);
+            int row = (p - 0x1800) >> 5;
+            N->dirtyCells[row] |= bit;
+            if (nxBankRead(N, 5)[p] & 0x80)
             {
-                PostQuitMessage(0);
+                N->flashCells[row] |= bit;
             }
-            info->handle = INVALID_HANDLE_VALUE;
-            break;
-
-        case WM_KEYDOWN:
+            else
             {
-                int scale = 0;
-                switch (w)
-                {
-                case VK_ESCAPE:
-                    PostMessageA(wnd, WM_CLOSE, 0, 0);
-                    break;
-
-                case VK_F1:     scale = 1;      break;
-                case VK_F2:     scale = 2;      break;
-                case VK_F3:     scale = 3;      break;
-                case VK_F4:     scale = 4;      break;
-                }
-
-                if (scale)
-                {
-                    int wndWidth = gWindows[info->N->window].imageWidth * scale;
-                    int wndHeight = gWindows[info->N->window].imageHeight * scale;
-                    gWindows[info->N->window].windowWidth = wndWidth;
-                    gWindows[info->N->window].windowHeight = wndHeight;
-
-                    RECT r = { 0, 0, wndWidth, wndHeight };
-                    DWORD style = GetWindowLongA(wnd, GWL_STYLE);
-                    DWORD exStyle = GetWindowLongA(wnd, GWL_EXSTYLE);
-                    AdjustWindowRectEx(&r, style, FALSE, exStyle);
-
-                    SetWindowPos(wnd, 0, 0, 0, r.right - r.left, r.bottom - r.top,
-                        SWP_NOMOVE | SWP_NOZORDER);
-                }
+                N->flashCells[row] &= ~bit;
             }
-            break;
+            visible = NX_YES;
+        }
+    }
 
-        default:
-            return DefWindowProcA(wnd, msg, w, l);
+    if (N->layer2Enable)
+    {
+        nxByte start = N->layer2ShadowEnable ? N->layer2ShadowBankStart : N->layer2BankStart;
+        if (bank >= start && bank < start + 3)
+        {
+            // Each bank is 64 rows of 256 pixels
+            int y = (bank - start) * 64 + (p >> 8);
+            N->dirtyCells[y >> 3] |= (nxDword)1 << ((p & 0xff) >> 3);
+            visible = NX_YES;
         }
     }
 
-    return 0;
+    return visible;
 }
 
-Window nxWin32MakeWindow(const char* title, Next N, int scale)
+// Bits first..last of a row of cells.
+NxInternal nxDword nxCellBits(int first, int last)
 {
-    WindowCreateInfo wci;
-    Window w = nxWin32AllocHandle();
-    int width = NX_WINDOW_WIDTH;
-    int height = NX_WINDOW_HEIGHT;
-    nxDword* img = N->image;
-
-    nxMemoryClear(&gWindows[w], sizeof(WindowInfo));
-
-    wci.handle = w;
+    nxDword upTo = last == 31 ? 0xffffffff : ((nxDword)1 << (last + 1)) - 1;
+    return upTo & ~(((nxDword)1 << first) - 1);
+}
 
-    gWindows[w].N = N;
-    gWindows[w].handle = 0;
-    gWindows[w].imageWidth = width;
-    gWindows[w].imageHeight = height;
-    gWindows[w].windowWidth = width * scale;
-    gWindows[w].windowHeight = width * scale;
+// Mark the cells affected by writing count bytes to a bank from p, after they have been written, and record the blocks
+// they were in.  Works a pixel row at a time rather than a byte at a time.  Returns NX_YES if any of the write is
+// visible.
+NxInternal nxBool nxDirtyRange(Next N, nxByte bank, nxWord p, nxInt count)
+{
+    nxBool visible = NX_NO;
+    nxInt end = p + count;
+    if (!count) return NX_NO;
 
-    RECT r = { 0, 0, width * scale, height * scale };
-    int style = WS_OVERLAPPED | WS_CAPTION | WS_SYSMENU | WS_VISIBLE;
+    nxInt lastBlock = (end - 1) >> 8;
+    nxQword upTo = lastBlock == 63 ? ~(nxQword)0 : ((nxQword)1 << (lastBlock + 1)) - 1;
+    N->writtenBlocks[bank] |= upTo & ~(((nxQword)1 << (p >> 8)) - 1);
 
-    if (!gWindowClassAtom)
+    if (bank == 5 && p < 0x1b00)
     {
-        WNDCLASSEXA wc = { 0 };
-
-        wc.cbSize = sizeof(WNDCLASSEXA);
-        wc.style = CS_HREDRAW | CS_VREDRAW;
-        wc.lpfnWndProc = &nxWin32WindowProc;
-        wc.hInstance = GetModuleHandleA(0);
-        wc.hIcon = wc.hIconSm = LoadIconA(0, IDI_APPLICATION);
-        wc.hCursor = LoadCursorA(0, IDC_ARROW);
-        wc.hbrBackground = (HBRUSH)GetStockObject(BLACK_BRUSH);
-        wc.lpszClassName = "k_bitmap_window";
+        // Rows of 32 bytes, which never straddle the pixels and attributes
+        nxInt ulaEnd = NX_MIN(end, 0x1b00);
+        for (nxInt a = p; a < ulaEnd;)
+        {
+            nxInt rowEnd = NX_MIN((a | 0x1f) + 1, ulaEnd);
+            nxDword bits = nxCellBits((int)(a & 0x1f), (int)((rowEnd - 1) & 0x1f));
 
-        gWindowClassAtom = RegisterClassExA(&wc);
+            if (a < 0x1800)
+            {
+                N->dirtyCells[((a >> 8) & 0x18) | ((a >> 5) & 0x07)] |= bits;
+            }
+            else
+            {
+                int row = (int)(a - 0x1800) >> 5;
+                N->dirtyCells[row] |= bits;
+                for (nxInt i = a; i < rowEnd; ++i)
+                {
+                    nxDword bit = (nxDword)1 << (i & 0x1f);
+                    if (nxBankRead(N, 5)[i] & 0x80)
+                    {
+                        N->flashCells[row] |= bit;
+                    }
+                    else
+                    {
+                        N->flashCells[row] &= ~bit;
+                    }
+                }
+            }
+            a = rowEnd;
+        }
+        visible = NX_YES;
     }
 
-    AdjustWindowRect(&r, style, FALSE);
-
-    gWindows[w].handle = CreateWindowA("k_bitmap_window", title, style,
-        CW_USEDEFAULT, CW_USEDEFAULT,
-        r.right - r.left, r.bottom - r.top,
-        0, 0, GetModuleHandleA(0), &wci);
-
-    ++gWindowRefCount;
+    if (N->layer2Enable)
+    {
+        nxByte start = N->layer2ShadowEnable ? N->layer2ShadowBankStart : N->layer2BankStart;
+        if (bank >= start && bank < start + 3)
+        {
+            // Rows of 256 pixels
+            for (nxInt a = p; a < end;)
+            {
+                nxInt rowEnd = NX_MIN((a | 0xff) + 1, end);
+                int y = (bank - start) * 64 + (int)(a >> 8);
+                N->dirtyCells[y >> 3] |= nxCellBits((int)(a & 0xff) >> 3, (int)((rowEnd - 1) & 0xff) >> 3);
+                a = rowEnd;
+            }
+            visible = NX_YES;
+        }
+    }
 
-    return w;
+    return visible;
 }
 
-void nxWin32CloseWindow(Window window)
-{
-    SendMessageA(gWindows[window].handle, WM_CLOSE, 0, 0);
-}
+//
+// MMU
+//
+// Every access to the 64K goes through a pointer per 8K slot, so nxPeek and nxPoke are a shift and an index.  The
+// pointers are rebuilt whenever the MMU registers or the Layer 2 write mapping change, which is far rarer than
+// accesses.
+//
 
-nxBool nxWin32Pump()
+NxInternal void nxMmuMapSlot(Next N, int page, nxByte** mem, nxByte* bank, nxWord* base, nxBool isWrite)
 {
-    nxBool cont = NX_YES;
-    MSG msg;
-
-    while (PeekMessageA(&msg, 0, 0, 0, PM_NOREMOVE))
+    // Page $ff is the ROM, even with 2MB of RAM
+    if (page < NX_MIN(N->numBanks * 2, 0xff))
     {
-        if (!GetMessageA(&msg, 0, 0, 0)) cont = NX_NO;
-        TranslateMessage(&msg);
-        DispatchMessageA(&msg);
+        *bank = (nxByte)(page >> 1);
+        *base = (page & 1) ? 8192 : 0;
+        if (isWrite)
+        {
+            NxBank* B = N->banks[*bank];
+            *mem = (B && nxAtomicGet(&B->refs) == 1) ? B->mem + *base : 0;
+        }
+        else
+        {
+            *mem = (nxByte *)nxBankRead(N, *bank) + *base;
+        }
+    }
+    else
+    {
+        *mem = isWrite ? N->unmappedWrite : N->unmappedRead;
+        *bank = 0xff;
+        *base = 0;
     }
-
-    return cont;
 }
 
-void nxWin32Lock()
+// Rebuild the slot pointers from the MMU registers and the Layer 2 write mapping.
+NxInternal void nxMmuUpdate(Next N)
 {
-    ++gWindowRefCount;
-}
+    for (int slot = 0; slot < 8; ++slot)
+    {
+        nxMmuMapSlot(N, N->mmu[slot], &N->readMap[slot], &N->readBank[slot], &N->readBase[slot], NX_NO);
+        nxMmuMapSlot(N, N->mmu[slot], &N->writeMap[slot], &N->writeBank[slot], &N->writeBase[slot], NX_YES);
+    }
 
-void nxWin32Unlock()
-{
-    --gWindowRefCount;
+    if (N->layer2Write0)
+    {
+        // Writes to the first 16K go to the current Layer 2 bank
+        int bank = N->layer2ShadowEnable ? N->layer2ShadowBankStart + N->layer2Bank
+                                         : N->layer2BankStart + N->layer2Bank;
+        for (int slot = 0; slot < 2; ++slot)
+        {
+            nxMmuMapSlot(N, bank * 2 + slot, &N->writeMap[slot], &N->writeBank[slot], &N->writeBase[slot], NX_YES);
+        }
+    }
 }
 
-void nxWin32Redraw(Window window)
+// Map a 16K bank into $c000-$ffff, as the 128K and +3 paging ports do.
+NxInternal void nxMmuSetBank(Next N, nxByte bank)
 {
-    InvalidateRect(gWindows[window].handle, 0, FALSE);
+    // Banks from 128 have no page number, so map $ff, which is never RAM
+    int page = bank * 2;
+    N->mmu[6] = page < 256 ? (nxByte)page : 0xff;
+    N->mmu[7] = page < 256 ? (nxByte)(page + 1) : 0xff;
+    nxMmuUpdate(N);
 }
 
-void nxDataUnload(NxData d)
+//
+// Video state
+//
+// Everything the renderer reads is gathered into an NxVideo, so that it can render either straight from the context
+// or from a snapshot of it.
+//
+
+typedef struct
 {
-    if (d.bytes)        UnmapViewOfFile(d.bytes);
-    if (d.fileMap)      CloseHandle(d.fileMap);
-    if (d.file)         CloseHandle(d.file);
+    const nxByte*       ula;                        // Bank 5
+    const nxByte*       layer2[3];                  // Displayed Layer 2 banks
+    const NxPalette*    ulaPalette;                 // Displayed palettes, with their caches up to date
+    const NxPalette*    layer2Palette;
+    const nxDword*      ulaInk;                     // Ink and paper for each attribute in the current flash state
+    const nxDword*      ulaPaper;
+    nxByte              border;
+    nxBool              flash;
+    nxBool              layer2Enable;
+    nxByte              layer2Transparent;
+    NxRenderPath        path;
 
-    d.bytes = 0;
-    d.size = 0;
-    d.file = INVALID_HANDLE_VALUE;
-    d.fileMap = INVALID_HANDLE_VALUE;
+    nxDword*            image;                      // Output
+    const nxDword*      dirtyCells;                 // Cells to render, one row of bits per cell row
+    nxBool              dirtyBorder;                // Render the border too
 }
+NxVideo;
 
-NxData nxDataLoad(const char* fileName)
+// Render the border on the image rows y0 to y1 - 1.
+NxInternal void nxRenderBorder(const NxVideo* V, int y0, int y1)
 {
-    NxData d = { 0 };
+    // The border uses the paper colours
+    nxDword colour = V->ulaPalette->argb[16 + (V->border & 0x7)];
+    nxDword* img = V->image + y0 * NX_WINDOW_WIDTH;
 
-    d.file = CreateFileA(fileName, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, 0, 0);
-    if (d.file)
+    for (int r = y0 - NX_BORDER_HEIGHT; r < y1 - NX_BORDER_HEIGHT; ++r)
     {
-        DWORD fileSizeHigh, fileSizeLow;
-        fileSizeLow = GetFileSize(d.file, &fileSizeHigh);
-        d.fileMap = CreateFileMappingA(d.file, 0, PAGE_READONLY, fileSizeHigh, fileSizeLow, 0);
-
-        if (d.fileMap)
+        if (r < 0 || r >= NX_SCREEN_HEIGHT)
         {
-            d.bytes = MapViewOfFile(d.fileMap, FILE_MAP_READ, 0, 0, 0);
-            d.size = ((nxInt)fileSizeHigh << 32) | fileSizeLow;
+            for (int c = 0; c < NX_WINDOW_WIDTH; ++c) img[c] = colour;
         }
         else
         {
-            nxDataUnload(d);
+            for (int c = 0; c < NX_BORDER_WIDTH; ++c)
+            {
+                img[c] = colour;
+                img[NX_WINDOW_WIDTH - NX_BORDER_WIDTH + c] = colour;
+            }
         }
+        img += NX_WINDOW_WIDTH;
     }
-
-    return d;
 }
 
-NxData nxDataMake(const char* fileName, nxInt size)
-{
-    NxData d = { 0 };
+// Render count cells of a single pixel row, starting at cell column cx.
+typedef void (*NxUlaSpan)(const NxVideo* V, nxDword* img, int row, int cx, int count);
 
-    d.file = CreateFileA(fileName, GENERIC_READ | GENERIC_WRITE, 0, 0, CREATE_ALWAYS, 0, 0);
-    if (d.file)
+// Reference renderer, a pixel at a time.
+NxInternal void nxUlaSpanReference(const NxVideo* V, nxDword* img, int row, int cx, int count)
+{
+    // Video data.
+    //  Pixels address is 010S SRRR CCCX XXXX
+    //  Attrs address is 0101 10YY YYYX XXXX
+    //  S = Section (0-2)
+    //  C = Cell row within section (0-7)
+    //  R = Pixel row within cell (0-7)
+    //  X = X coord (0-31)
+    //  Y = Y coord (0-23)
+    //
+    //  ROW = SSCC CRRR
+    //      = YYYY Y000
+    nxWord p = ((row & 0x0c0) << 5) + ((row & 0x7) << 8) + ((row & 0x38) << 2) + cx;
+    nxWord a = 0x1800 + ((row & 0xf8) << 2) + cx;
+    const nxWord* colours = V->ulaPalette->colours;
+
+    for (int c = 0; c < count; ++c)
     {
-        DWORD fileSizeLow = (size & 0xffffffff);
-        DWORD fileSizeHigh = (size >> 32);
-        d.fileMap = CreateFileMappingA(d.file, 0, PAGE_READWRITE, fileSizeHigh, fileSizeLow, 0);
+        nxByte data = V->ula[p++];
+        nxByte attr = V->ula[a++];
+        nxDword ink = nxColourToArgb(colours[(attr & 7) + ((attr & 0x40) >> 3)]);
+        nxDword paper = nxColourToArgb(colours[16 + ((attr & 0x7f) >> 3)]);
+        nxBool flash = NX_AS_BOOL(attr & 0x80);
 
-        if (d.fileMap)
+        if (flash && V->flash)
         {
-            d.bytes = MapViewOfFile(d.fileMap, FILE_MAP_WRITE, 0, 0, 0);
-            d.size = size;
+            nxDword t = ink;
+            ink = paper;
+            paper = t;
         }
-        else
+
+        for (int i = 7; i >= 0; --i)
         {
-            nxDataUnload(d);
+            img[i] = (data & 1) ? ink : paper;
+            data >>= 1;
         }
+        img += 8;
     }
-
-    return d;
 }
 
-#endif // _WIN32
+//
+// Table driven ULA renderer
+//
+// Each pixel row of the screen is rendered as a span of cells.  The row address is looked up instead of calculated,
+// the attribute is converted to ink and paper with a table (which also handles flash), and each bitmap byte is
+// expanded to 8 pixel masks with a table so the 8 output pixels can be written with a select and a wide store.
+//
+
+// Offset into bank 5 of the first byte of each pixel row.
+static nxWord kUlaRowAddress[NX_SCREEN_HEIGHT];
+
+// Expansion of a bitmap byte into 8 masks (0xffffffff for ink, 0 for paper), left-most pixel first.
+static nxDword kUlaExpand[256][8];
+
+static NxOnce gUlaTablesOnce = NX_ONCE_INIT;
+
+NxInternal void nxUlaMakeTables(void)
+{
+    for (int r = 0; r < NX_SCREEN_HEIGHT; ++r)
+    {
+        kUlaRowAddress[r] = (nxWord)(((r & 0x0c0) << 5) + ((r & 0x7) << 8) + ((r & 0x38) << 2));
+    }
+
+    for (int b = 0; b < 256; ++b)
+    {
+        for (int i = 0; i < 8; ++i)
+        {
+            kUlaExpand[b][i] = (b & (0x80 >> i)) ? 0xffffffff : 0;
+        }
+    }
+}
+
+// Rebuild the ink and paper colours for each attribute if the ULA palette has changed since they were built.
+NxInternal void nxUlaMakeColours(Next N)
+{
+    NxPalette* P = nxActivePalette(N, NX_PALETTE_ULA);
+    if (P == N->ulaColoursPalette && P->version == N->ulaColoursVersion) return;
+
+    const nxDword* argb = nxPaletteCache(P)->argb;
+    for (int a = 0; a < 256; ++a)
+    {
+        nxDword ink = argb[(a & 7) + ((a & 0x40) >> 3)];
+        nxDword paper = argb[16 + ((a & 0x7f) >> 3)];
+        N->ulaInk[0][a] = ink;
+        N->ulaPaper[0][a] = paper;
+        N->ulaInk[1][a] = (a & 0x80) ? paper : ink;
+        N->ulaPaper[1][a] = (a & 0x80) ? ink : paper;
+    }
+
+    N->ulaColoursPalette = P;
+    N->ulaColoursVersion = P->version;
+}
+
+NxInternal void nxUlaSpanTable(const NxVideo* V, nxDword* img, int row, int cx, int count)
+{
+    const nxByte* pixels = V->ula + kUlaRowAddress[row] + cx;
+    const nxByte* attrs = V->ula + 0x1800 + ((row >> 3) << 5) + cx;
+    const nxDword* inks = V->ulaInk;
+    const nxDword* papers = V->ulaPaper;
+
+    for (int i = 0; i < count; ++i)
+    {
+        const nxDword* mask = kUlaExpand[pixels[i]];
+        nxDword paper = papers[attrs[i]];
+        nxDword diff = inks[attrs[i]] ^ paper;
+
+        for (int b = 0; b < 8; ++b)
+        {
+            img[b] = paper ^ (diff & mask[b]);
+        }
+        img += 8;
+    }
+}
+
+#ifdef NX_SIMD_X86
+
+NX_TARGET_SSE2 NxInternal void nxUlaSpanSSE2(const NxVideo* V, nxDword* img, int row, int cx, int count)
+{
+    const nxByte* pixels = V->ula + kUlaRowAddress[row] + cx;
+    const nxByte* attrs = V->ula + 0x1800 + ((row >> 3) << 5) + cx;
+    const nxDword* inks = V->ulaInk;
+    const nxDword* papers = V->ulaPaper;
+
+    for (int i = 0; i < count; ++i)
+    {
+        const __m128i* mask = (const __m128i *)kUlaExpand[pixels[i]];
+        __m128i paper = _mm_set1_epi32((int)papers[attrs[i]]);
+        __m128i diff = _mm_xor_si128(_mm_set1_epi32((int)inks[attrs[i]]), paper);
+
+        _mm_storeu_si128((__m128i *)img, _mm_xor_si128(paper, _mm_and_si128(diff, _mm_loadu_si128(mask))));
+        _mm_storeu_si128((__m128i *)(img + 4), _mm_xor_si128(paper, _mm_and_si128(diff, _mm_loadu_si128(mask + 1))));
+        img += 8;
+    }
+}
+
+NX_TARGET_AVX2 NxInternal void nxUlaSpanAVX2(const NxVideo* V, nxDword* img, int row, int cx, int count)
+{
+    const nxByte* pixels = V->ula + kUlaRowAddress[row] + cx;
+    const nxByte* attrs = V->ula + 0x1800 + ((row >> 3) << 5) + cx;
+    const nxDword* inks = V->ulaInk;
+    const nxDword* papers = V->ulaPaper;
+
+    for (int i = 0; i < count; ++i)
+    {
+        __m256i mask = _mm256_loadu_si256((const __m256i *)kUlaExpand[pixels[i]]);
+        __m256i paper = _mm256_set1_epi32((int)papers[attrs[i]]);
+        __m256i diff = _mm256_xor_si256(_mm256_set1_epi32((int)inks[attrs[i]]), paper);
+
+        _mm256_storeu_si256((__m256i *)img, _mm256_xor_si256(paper, _mm256_and_si256(diff, mask)));
+        img += 8;
+    }
+}
+
+NxInternal nxBool nxCpuHasSSE2()
+{
+#if defined(_M_X64) || defined(__x86_64__)
+    return NX_YES;
+#elif defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    return NX_AS_BOOL(info[3] & (1 << 26));
+#else
+    __builtin_cpu_init();
+    return NX_AS_BOOL(__builtin_cpu_supports("sse2"));
+#endif
+}
+
+NxInternal nxBool nxCpuHasAVX2()
+{
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) return NX_NO;
+
+    // The OS must save the YMM registers too (OSXSAVE + AVX, then XCR0)
+    __cpuid(info, 1);
+    if ((info[2] & 0x18000000) != 0x18000000) return NX_NO;
+    if ((_xgetbv(0) & 6) != 6) return NX_NO;
+
+    __cpuidex(info, 7, 0);
+    return NX_AS_BOOL(info[1] & (1 << 5));
+#else
+    __builtin_cpu_init();
+    return NX_AS_BOOL(__builtin_cpu_supports("avx2"));
+#endif
+}
+
+#endif // NX_SIMD_X86
+
+// Return the fastest supported path that is no faster than the one asked for.
+NxInternal NxRenderPath nxResolveRenderPath(NxRenderPath path)
+{
+    if (path == NX_RENDER_AUTO) path = NX_RENDER_AVX2;
+
+#ifdef NX_SIMD_X86
+    if (path == NX_RENDER_AVX2 && !nxCpuHasAVX2()) path = NX_RENDER_SSE2;
+    if (path == NX_RENDER_SSE2 && !nxCpuHasSSE2()) path = NX_RENDER_TABLE;
+#else
+    if (path == NX_RENDER_AVX2 || path == NX_RENDER_SSE2) path = NX_RENDER_TABLE;
+#endif
+
+    return path;
+}
+
+NxInternal NxUlaSpan nxUlaSpanFor(NxRenderPath path)
+{
+    switch (path)
+    {
+    case NX_RENDER_REFERENCE:   return &nxUlaSpanReference;
+#ifdef NX_SIMD_X86
+    case NX_RENDER_SSE2:        return &nxUlaSpanSSE2;
+    case NX_RENDER_AVX2:        return &nxUlaSpanAVX2;
+#endif
+    default:                    return &nxUlaSpanTable;
+    }
+}
+
+// Render count cells in the cell row cy, starting at cell column cx.
+NxInternal void nxRenderULACells(const NxVideo* V, int cx, int cy, int count)
+{
+    NxUlaSpan span = nxUlaSpanFor(V->path);
+    nxDword* img = V->image + (NX_BORDER_HEIGHT + cy * 8) * NX_WINDOW_WIDTH + NX_BORDER_WIDTH + cx * 8;
+    for (int r = cy * 8; r < cy * 8 + 8; ++r)
+    {
+        span(V, img, r, cx, count);
+        img += NX_WINDOW_WIDTH;
+    }
+}
+
+//
+// Layer 2 compositor
+//
+// Pixels are read straight from the Layer 2 banks a row at a time, converted to ARGB using a cached copy of the
+// palette and written over the ULA output wherever they are not the transparent index.
+//
+
+// Composite count Layer 2 pixels from src over img.
+typedef void (*NxLayer2Span)(const nxByte* src, nxDword* img, int count, const NxPalette* P, nxByte transparent);
+
+// Reference compositor, converting each pixel's colour from the palette.
+NxInternal void nxLayer2SpanReference(const nxByte* src, nxDword* img, int count, const NxPalette* P,
+                                      nxByte transparent)
+{
+    for (int i = 0; i < count; ++i)
+    {
+        nxByte pixel = src[i];
+        if (pixel != transparent)
+        {
+            img[i] = nxColourToArgb(P->colours[pixel]);
+        }
+    }
+}
+
+NxInternal void nxLayer2SpanTable(const nxByte* src, nxDword* img, int count, const NxPalette* P, nxByte transparent)
+{
+    const nxDword* argb = P->argb;
+
+    for (int i = 0; i < count; ++i)
+    {
+        if (src[i] != transparent) img[i] = argb[src[i]];
+    }
+}
+
+#ifdef NX_SIMD_X86
+
+// There is no gather in SSE2, so the colours are looked up one at a time and only the blend is done 8 pixels wide.
+NX_TARGET_SSE2 NxInternal void nxLayer2SpanSSE2(const nxByte* src, nxDword* img, int count, const NxPalette* P,
+                                                nxByte transparent)
+{
+    const nxDword* argb = P->argb;
+    __m128i t = _mm_set1_epi8((char)transparent);
+
+    for (int i = 0; i < count; i += 8)
+    {
+        __m128i pixels = _mm_loadl_epi64((const __m128i *)(src + i));
+        __m128i mask8 = _mm_cmpeq_epi8(pixels, t);
+        int clear = _mm_movemask_epi8(mask8) & 0xff;
+
+        if (clear == 0xff) continue;
+
+        const nxByte* p = src + i;
+        __m128i c0 = _mm_setr_epi32((int)argb[p[0]], (int)argb[p[1]], (int)argb[p[2]], (int)argb[p[3]]);
+        __m128i c1 = _mm_setr_epi32((int)argb[p[4]], (int)argb[p[5]], (int)argb[p[6]], (int)argb[p[7]]);
+        __m128i* dst = (__m128i *)(img + i);
+
+        if (clear)
+        {
+            // Widen the byte mask to one dword per pixel and keep the ULA pixel where it is set
+            __m128i mask16 = _mm_unpacklo_epi8(mask8, mask8);
+            __m128i m0 = _mm_unpacklo_epi16(mask16, mask16);
+            __m128i m1 = _mm_unpackhi_epi16(mask16, mask16);
+            c0 = _mm_or_si128(_mm_andnot_si128(m0, c0), _mm_and_si128(m0, _mm_loadu_si128(dst)));
+            c1 = _mm_or_si128(_mm_andnot_si128(m1, c1), _mm_and_si128(m1, _mm_loadu_si128(dst + 1)));
+        }
+
+        _mm_storeu_si128(dst, c0);
+        _mm_storeu_si128(dst + 1, c1);
+    }
+}
+
+NX_TARGET_AVX2 NxInternal void nxLayer2SpanAVX2(const nxByte* src, nxDword* img, int count, const NxPalette* P,
+                                                nxByte transparent)
+{
+    const nxDword* argb = P->argb;
+    __m256i t = _mm256_set1_epi32(transparent);
+
+    for (int i = 0; i < count; i += 8)
+    {
+        __m256i index = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(src + i)));
+        __m256i colours = _mm256_i32gather_epi32((const int *)argb, index, 4);
+        __m256i mask = _mm256_cmpeq_epi32(index, t);
+        __m256i* dst = (__m256i *)(img + i);
+
+        _mm256_storeu_si256(dst, _mm256_blendv_epi8(colours, _mm256_loadu_si256(dst), mask));
+    }
+}
+
+#endif // NX_SIMD_X86
+
+NxInternal NxLayer2Span nxLayer2SpanFor(NxRenderPath path)
+{
+    switch (path)
+    {
+    case NX_RENDER_REFERENCE:   return &nxLayer2SpanReference;
+#ifdef NX_SIMD_X86
+    case NX_RENDER_SSE2:        return &nxLayer2SpanSSE2;
+    case NX_RENDER_AVX2:        return &nxLayer2SpanAVX2;
+#endif
+    default:                    return &nxLayer2SpanTable;
+    }
+}
+
+// Render count cells of Layer 2 in the cell row cy, starting at cell column cx.
+NxInternal void nxRenderLayer2Cells(const NxVideo* V, int cx, int cy, int count)
+{
+    NxLayer2Span span = nxLayer2SpanFor(V->path);
+
+    // 8 cell rows per bank
+    const nxByte* src = V->layer2[cy >> 3] + ((cy & 7) << 11) + (cx << 3);
+    nxDword* img = V->image + (NX_BORDER_HEIGHT + cy * 8) * NX_WINDOW_WIDTH + NX_BORDER_WIDTH + cx * 8;
+
+    for (int row = 0; row < 8; ++row)
+    {
+        span(src, img, count * 8, V->layer2Palette, V->layer2Transparent);
+        src += NX_SCREEN_WIDTH;
+        img += NX_WINDOW_WIDTH;
+    }
+}
+
+//
+// Frame rendering
+//
+// The image is split into horizontal bands of NX_RENDER_BAND_HEIGHT rows.  Each band renders its part of the border
+// and its dirty cells (ULA then Layer 2), so bands can be rendered in parallel by the worker pool without sharing any
+// output.
+//
+
+#define NX_RENDER_BAND_HEIGHT   32
+#define NX_RENDER_NUM_BANDS     (NX_WINDOW_HEIGHT / NX_RENDER_BAND_HEIGHT)
+
+NxInternal void nxRenderBand(void* data, int band)
+{
+    const NxVideo* V = (const NxVideo *)data;
+    int y0 = band * NX_RENDER_BAND_HEIGHT;
+    int y1 = y0 + NX_RENDER_BAND_HEIGHT;
+
+    if (V->dirtyBorder)
+    {
+        nxRenderBorder(V, y0, y1);
+    }
+
+    int cy0 = NX_MAX(y0 - NX_BORDER_HEIGHT, 0) / 8;
+    int cy1 = NX_MIN(y1 - NX_BORDER_HEIGHT, NX_SCREEN_HEIGHT) / 8;
+
+    for (int cy = cy0; cy < cy1; ++cy)
+    {
+        nxDword cells = V->dirtyCells[cy];
+        int cx = 0;
+
+        // Render each run of dirty cells in one go
+        while (cells)
+        {
+            int count = 0;
+            while (!(cells & 1))
+            {
+                cells >>= 1;
+                ++cx;
+            }
+            while (cells & 1)
+            {
+                cells >>= 1;
+                ++count;
+            }
+
+            nxRenderULACells(V, cx, cy, count);
+            if (V->layer2Enable)
+            {
+                nxRenderLayer2Cells(V, cx, cy, count);
+            }
+            cx += count;
+        }
+    }
+}
+
+// Render the dirty parts of V, using the pool if there is one.
+NxInternal void nxRenderVideo(const NxVideo* V, NxPool* pool)
+{
+    if (pool)
+    {
+        nxPoolRun(pool, &nxRenderBand, (void *)V, NX_RENDER_NUM_BANDS);
+    }
+    else
+    {
+        for (int band = 0; band < NX_RENDER_NUM_BANDS; ++band) nxRenderBand((void *)V, band);
+    }
+}
+
+// Describe the current state of the context for the renderer.  The palette caches and attribute colours are brought
+// up to date first, so the renderer only ever reads them.
+NxInternal void nxVideoFromNext(Next N, NxVideo* V)
+{
+    nxByte bank = N->layer2ShadowEnable ? N->layer2ShadowBankStart : N->layer2BankStart;
+
+    nxUlaMakeColours(N);
+
+    V->ula = nxBankRead(N, 5);
+    for (int i = 0; i < 3; ++i) V->layer2[i] = nxBankRead(N, bank + i);
+    V->ulaPalette = nxPaletteCache(nxActivePalette(N, NX_PALETTE_ULA));
+    V->layer2Palette = nxPaletteCache(nxActivePalette(N, NX_PALETTE_LAYER2));
+    V->ulaInk = N->ulaInk[N->flash ? 1 : 0];
+    V->ulaPaper = N->ulaPaper[N->flash ? 1 : 0];
+    V->border = N->border;
+    V->flash = N->flash;
+    V->layer2Enable = N->layer2Enable;
+    V->layer2Transparent = N->layer2Transparent;
+    V->path = N->renderPath;
+
+    V->image = N->image;
+    V->dirtyCells = N->dirtyCells;
+    V->dirtyBorder = N->dirtyBorder;
+}
+
+NxInternal void nxDirtyReset(Next N)
+{
+    for (int cy = 0; cy < NX_CELL_ROWS; ++cy) N->dirtyCells[cy] = 0;
+    N->dirtyBorder = NX_NO;
+}
+
+NxInternal nxBool nxDirtyPending(Next N)
+{
+    nxDword cells = 0;
+    for (int cy = 0; cy < NX_CELL_ROWS; ++cy) cells |= N->dirtyCells[cy];
+    return NX_AS_BOOL(cells || N->dirtyBorder);
+}
+
+// Render only the parts of the image that have changed since the last render.
+NxInternal void nxRender(Next N)
+{
+    // Scanline rendering builds the image as the frame runs, and threaded rendering uses its own image
+    if (N->renderMode != NX_RENDER_MODE_FRAME) return;
+
+    NxVideo V;
+    nxVideoFromNext(N, &V);
+    nxRenderVideo(&V, N->renderPool);
+    nxDirtyReset(N);
+}
+
+//
+// Scanline rendering
+//
+// The image is rendered a whole line at a time as emulated time reaches each line in the frame, using whatever state
+// the machine is in at that moment.  This spreads the cost of rendering over the frame and shows mid-frame changes to
+// the border, Layer 2 and video memory the way the hardware does.
+//
+
+#define NX_FRAME_LINES          312     // Lines in a 50Hz frame
+#define NX_FRAME_FIRST_LINE     32      // Frame line shown at the top of the image
+
+NxInternal void nxRenderLine(const NxVideo* V, int y)
+{
+    nxRenderBorder(V, y, y + 1);
+
+    int row = y - NX_BORDER_HEIGHT;
+    if (row >= 0 && row < NX_SCREEN_HEIGHT)
+    {
+        nxDword* img = V->image + y * NX_WINDOW_WIDTH + NX_BORDER_WIDTH;
+        nxUlaSpanFor(V->path)(V, img, row, 0, NX_CELL_COLUMNS);
+
+        if (V->layer2Enable)
+        {
+            // 64 rows per bank
+            const nxByte* src = V->layer2[row >> 6] + ((row & 63) << 8);
+            nxLayer2SpanFor(V->path)(src, img, NX_SCREEN_WIDTH, V->layer2Palette, V->layer2Transparent);
+        }
+    }
+}
+
+// Render the image lines from the last one rendered up to, but not including, line y.
+NxInternal void nxRenderLinesTo(Next N, int y)
+{
+    if (N->scanline >= y) return;
+
+    NxVideo V;
+    nxVideoFromNext(N, &V);
+
+    while (N->scanline < y)
+    {
+        nxRenderLine(&V, N->scanline++);
+    }
+}
+
+//
+// Scaling
+//
+// The image is zoomed by whole numbers with nearest-neighbour scaling: each row is widened once by repeating every
+// pixel, then the widened row is copied to the rows below it.  The SIMD paths widen 4 (SSE2) or 8 (AVX2) pixels at a
+// time with shuffles.
+//
+
+#define NX_MAX_SCALE            4
+
+typedef void (*NxScaleSpan)(const nxDword* src, nxDword* dst, int count, int scale);
+
+NxInternal void nxScaleSpanReference(const nxDword* src, nxDword* dst, int count, int scale)
+{
+    for (int i = 0; i < count; ++i)
+    {
+        for (int s = 0; s < scale; ++s) *dst++ = src[i];
+    }
+}
+
+#ifdef NX_SIMD_X86
+
+NX_TARGET_SSE2 NxInternal void nxScaleSpanSSE2(const nxDword* src, nxDword* dst, int count, int scale)
+{
+    int i = 0;
+    __m128i* out = (__m128i *)dst;
+
+    switch (scale)
+    {
+    case 2:
+        for (; i + 4 <= count; i += 4, out += 2)
+        {
+            __m128i p = _mm_loadu_si128((const __m128i *)(src + i));
+            _mm_storeu_si128(out, _mm_unpacklo_epi32(p, p));
+            _mm_storeu_si128(out + 1, _mm_unpackhi_epi32(p, p));
+        }
+        break;
+
+    case 3:
+        for (; i + 4 <= count; i += 4, out += 3)
+        {
+            __m128i p = _mm_loadu_si128((const __m128i *)(src + i));
+            _mm_storeu_si128(out, _mm_shuffle_epi32(p, _MM_SHUFFLE(1, 0, 0, 0)));
+            _mm_storeu_si128(out + 1, _mm_shuffle_epi32(p, _MM_SHUFFLE(2, 2, 1, 1)));
+            _mm_storeu_si128(out + 2, _mm_shuffle_epi32(p, _MM_SHUFFLE(3, 3, 3, 2)));
+        }
+        break;
+
+    case 4:
+        for (; i + 4 <= count; i += 4, out += 4)
+        {
+            __m128i p = _mm_loadu_si128((const __m128i *)(src + i));
+            _mm_storeu_si128(out, _mm_shuffle_epi32(p, _MM_SHUFFLE(0, 0, 0, 0)));
+            _mm_storeu_si128(out + 1, _mm_shuffle_epi32(p, _MM_SHUFFLE(1, 1, 1, 1)));
+            _mm_storeu_si128(out + 2, _mm_shuffle_epi32(p, _MM_SHUFFLE(2, 2, 2, 2)));
+            _mm_storeu_si128(out + 3, _mm_shuffle_epi32(p, _MM_SHUFFLE(3, 3, 3, 3)));
+        }
+        break;
+    }
+
+    nxScaleSpanReference(src + i, dst + i * scale, count - i, scale);
+}
+
+NX_TARGET_AVX2 NxInternal void nxScaleSpanAVX2(const nxDword* src, nxDword* dst, int count, int scale)
+{
+    // Source pixel for each output pixel, 8 output pixels per row
+    static const int kPermute[3][4][8] =
+    {
+        {
+            { 0, 0, 1, 1, 2, 2, 3, 3 }, { 4, 4, 5, 5, 6, 6, 7, 7 },
+        },
+        {
+            { 0, 0, 0, 1, 1, 1, 2, 2 }, { 2, 3, 3, 3, 4, 4, 4, 5 }, { 5, 5, 6, 6, 6, 7, 7, 7 },
+        },
+        {
+            { 0, 0, 0, 0, 1, 1, 1, 1 }, { 2, 2, 2, 2, 3, 3, 3, 3 },
+            { 4, 4, 4, 4, 5, 5, 5, 5 }, { 6, 6, 6, 6, 7, 7, 7, 7 },
+        },
+    };
+
+    int i = 0;
+    if (scale >= 2)
+    {
+        __m256i idx[4];
+        for (int v = 0; v < scale; ++v) idx[v] = _mm256_loadu_si256((const __m256i *)kPermute[scale - 2][v]);
+
+        __m256i* out = (__m256i *)dst;
+        for (; i + 8 <= count; i += 8)
+        {
+            __m256i p = _mm256_loadu_si256((const __m256i *)(src + i));
+            for (int v = 0; v < scale; ++v)
+            {
+                _mm256_storeu_si256(out++, _mm256_permutevar8x32_epi32(p, idx[v]));
+            }
+        }
+    }
+
+    nxScaleSpanReference(src + i, dst + i * scale, count - i, scale);
+}
+
+#endif // NX_SIMD_X86
+
+NxInternal NxScaleSpan nxScaleSpanFor(NxRenderPath path)
+{
+    switch (path)
+    {
+    case NX_RENDER_REFERENCE:
+    case NX_RENDER_TABLE:   return &nxScaleSpanReference;
+#ifdef NX_SIMD_X86
+    case NX_RENDER_SSE2:    return &nxScaleSpanSSE2;
+    case NX_RENDER_AVX2:    return &nxScaleSpanAVX2;
+#endif
+    default:                return &nxScaleSpanReference;
+    }
+}
+
+// Zoom the whole image into dst, which must hold (NX_WINDOW_WIDTH * scale) x (NX_WINDOW_HEIGHT * scale) pixels.
+NxInternal void nxScaleImage(const nxDword* src, nxDword* dst, int scale, NxRenderPath path)
+{
+    NxScaleSpan span = nxScaleSpanFor(path);
+    int width = NX_WINDOW_WIDTH * scale;
+
+    for (int y = 0; y < NX_WINDOW_HEIGHT; ++y)
+    {
+        span(src, dst, NX_WINDOW_WIDTH, scale);
+        for (int s = 1; s < scale; ++s)
+        {
+            nxMemoryCopy(dst, dst + width * s, sizeof(nxDword) * width);
+        }
+        src += NX_WINDOW_WIDTH;
+        dst += width * scale;
+    }
+}
+
+// Zoom the context's image by its scale, and return the scaled image.
+NxInternal const nxDword* nxScaleNext(Next N)
+{
+    if (N->scale == 1) return N->image;
+
+    if (!N->scaled)
+    {
+        N->scaled = (nxDword *)NX_ALLOC(sizeof(nxDword) * NX_WINDOW_WIDTH * NX_WINDOW_HEIGHT *
+                                        NX_MAX_SCALE * NX_MAX_SCALE);
+    }
+
+    nxScaleImage(N->image, N->scaled, N->scale, N->renderPath);
+    return N->scaled;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Render thread
+//
+// In NX_RENDER_MODE_THREADED, nxUpdate copies the visible video memory and the state the renderer needs into a
+// snapshot at the end of each frame that changed something.  Snapshots are triple buffered: nxUpdate fills the back
+// buffer and swaps it with the ready buffer, and the render thread swaps the ready buffer with its front buffer when a
+// new one arrives.  Neither side ever waits for the other to finish with a buffer, so the frame routine can carry on
+// changing memory while the previous frame is rendered and presented.
+//----------------------------------------------------------------------------------------------------------------------
+
+typedef struct
+{
+    nxByte              ula[0x1b00];
+    nxByte              layer2[3][16384];
+    NxPalette           ulaPalette;
+    NxPalette           layer2Palette;
+    nxDword             ulaInk[256];
+    nxDword             ulaPaper[256];
+    NxVideo             video;                      // Points into the above
+}
+NxVideoSnapshot;
+
+typedef struct _NxPresenter
+{
+    Next                N;
+    NxThread            thread;
+    NxMutex             lock;
+    NxCond              wake;
+    NxVideoSnapshot     snapshots[3];
+    int                 back;                       // Filled by nxUpdate
+    int                 ready;                      // Latest complete snapshot
+    int                 front;                      // Being rendered
+    nxBool              fresh;                      // The ready snapshot has not been rendered yet
+    nxBool              repaint;                    // Present the last image again
+    nxBool              quit;
+    nxDword*            image;
+    int                 scale;                      // The context's scale when the thread started
+    nxDword*            scaled;                     // Image zoomed by scale, 0 if scale is 1
+    const nxDword*      output;                     // Image or scaled image, whichever is presented
+}
+NxPresenter;
+
+static const nxDword kAllCells[NX_CELL_ROWS] =
+{
+    0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff,
+    0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff,
+    0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff,
+};
+
+NxInternal void nxWindowPresent(Next N, const nxDword* image, int scale);
+
+// Copy everything the renderer needs from the context into S.  The whole frame will be rendered from it.
+NxInternal void nxVideoSnapshot(Next N, NxVideoSnapshot* S)
+{
+    NxVideo* V = &S->video;
+    nxVideoFromNext(N, V);
+
+    nxMemoryCopy(V->ula, S->ula, sizeof(S->ula));
+    V->ula = S->ula;
+
+    if (V->layer2Enable)
+    {
+        for (int i = 0; i < 3; ++i)
+        {
+            nxMemoryCopy(V->layer2[i], S->layer2[i], sizeof(S->layer2[i]));
+            V->layer2[i] = S->layer2[i];
+        }
+    }
+
+    S->ulaPalette = *V->ulaPalette;
+    S->layer2Palette = *V->layer2Palette;
+    nxMemoryCopy(V->ulaInk, S->ulaInk, sizeof(S->ulaInk));
+    nxMemoryCopy(V->ulaPaper, S->ulaPaper, sizeof(S->ulaPaper));
+    V->ulaPalette = &S->ulaPalette;
+    V->layer2Palette = &S->layer2Palette;
+    V->ulaInk = S->ulaInk;
+    V->ulaPaper = S->ulaPaper;
+
+    V->image = 0;
+    V->dirtyCells = kAllCells;
+    V->dirtyBorder = NX_YES;
+}
+
+NxInternal void nxPresenterThread(void* data)
+{
+    NxPresenter* P = (NxPresenter *)data;
+
+    nxMutexLock(&P->lock);
+    for (;;)
+    {
+        while (!P->quit && !P->fresh && !P->repaint) nxCondWait(&P->wake, &P->lock);
+        if (P->quit) break;
+
+        nxBool render = P->fresh;
+        if (render)
+        {
+            int t = P->front;
+            P->front = P->ready;
+            P->ready = t;
+            P->fresh = NX_NO;
+        }
+        P->repaint = NX_NO;
+        nxMutexUnlock(&P->lock);
+
+        if (render)
+        {
+            NxVideo* V = &P->snapshots[P->front].video;
+            V->image = P->image;
+            nxRenderVideo(V, P->N->renderPool);
+            if (P->scaled) nxScaleImage(P->image, P->scaled, P->scale, V->path);
+        }
+        nxWindowPresent(P->N, P->output, P->scale);
+
+        nxMutexLock(&P->lock);
+    }
+    nxMutexUnlock(&P->lock);
+}
+
+NxInternal NxPresenter* nxPresenterOpen(Next N)
+{
+    NxPresenter* P = (NxPresenter *)NX_ALLOC(sizeof(NxPresenter));
+    nxMemoryClear(P, sizeof(NxPresenter));
+    P->N = N;
+    P->back = 0;
+    P->ready = 1;
+    P->front = 2;
+    P->image = (nxDword *)NX_ALLOC(sizeof(nxDword) * NX_WINDOW_WIDTH * NX_WINDOW_HEIGHT);
+    nxMemoryCopy(N->image, P->image, sizeof(nxDword) * NX_WINDOW_WIDTH * NX_WINDOW_HEIGHT);
+    P->scale = N->scale;
+    P->scaled = P->scale > 1 ? (nxDword *)NX_ALLOC(sizeof(nxDword) * NX_WINDOW_WIDTH * NX_WINDOW_HEIGHT *
+                                                    P->scale * P->scale) : 0;
+    P->output = P->scaled ? P->scaled : P->image;
+    if (P->scaled) nxScaleImage(P->image, P->scaled, P->scale, N->renderPath);
+    nxMutexInit(&P->lock);
+    nxCondInit(&P->wake);
+
+    // Start with the current frame
+    nxVideoSnapshot(N, &P->snapshots[P->ready]);
+    P->fresh = NX_YES;
+    nxDirtyReset(N);
+
+    if (!nxThreadStart(&P->thread, &nxPresenterThread, P))
+    {
+        nxCondDone(&P->wake);
+        nxMutexDone(&P->lock);
+        NX_FREE(P->scaled);
+        NX_FREE(P->image);
+        NX_FREE(P);
+        return 0;
+    }
+
+    return P;
+}
+
+NxInternal void nxPresenterClose(NxPresenter* P)
+{
+    if (!P) return;
+
+    nxMutexLock(&P->lock);
+    P->quit = NX_YES;
+    nxCondSignal(&P->wake);
+    nxMutexUnlock(&P->lock);
+    nxThreadJoin(&P->thread);
+
+    // Carry on from the last image presented
+    nxMemoryCopy(P->image, P->N->image, sizeof(nxDword) * NX_WINDOW_WIDTH * NX_WINDOW_HEIGHT);
+
+    nxCondDone(&P->wake);
+    nxMutexDone(&P->lock);
+    NX_FREE(P->scaled);
+    NX_FREE(P->image);
+    NX_FREE(P);
+}
+
+// Snapshot the context if anything visible has changed, and hand it to the render thread.
+NxInternal void nxPresenterSubmit(NxPresenter* P)
+{
+    if (!nxDirtyPending(P->N)) return;
+
+    nxVideoSnapshot(P->N, &P->snapshots[P->back]);
+    nxDirtyReset(P->N);
+
+    nxMutexLock(&P->lock);
+    int t = P->back;
+    P->back = P->ready;
+    P->ready = t;
+    P->fresh = NX_YES;
+    nxCondSignal(&P->wake);
+    nxMutexUnlock(&P->lock);
+}
+
+#if NX_WINDOW_WIN32 || NX_WINDOW_X11
+// Ask the render thread to present the last image again, for when the window needs repainting.
+NxInternal void nxPresenterRepaint(NxPresenter* P)
+{
+    nxMutexLock(&P->lock);
+    P->repaint = NX_YES;
+    nxCondSignal(&P->wake);
+    nxMutexUnlock(&P->lock);
+}
+#endif
+
+//----------------------------------------------------------------------------------------------------------------------
+// Timing
+//
+// Time is measured with a monotonic high resolution clock, so it is wall time that can't jump.  Waiting for a
+// deadline uses a high resolution waitable timer on Windows (where Sleep() is only accurate to the 15.6ms scheduler
+// tick), and an absolute sleep or a timerfd on POSIX.  Windows wait for the deadline or their next event, whichever
+// comes first.
+//----------------------------------------------------------------------------------------------------------------------
+
+#define FRAME_RATE  50
+#define FRAME_TIME  (1.0 / (nxFloat)FRAME_RATE)
+
+#ifdef _WIN32
+
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+#   define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x00000002
+#endif
+
+static LARGE_INTEGER gClockFrequency;
+static NxOnce gClockOnce = NX_ONCE_INIT;
+
+NxInternal void nxClockInit(void)
+{
+    QueryPerformanceFrequency(&gClockFrequency);
+}
+
+// Seconds since an arbitrary point.
+NxInternal nxFloat nxClock()
+{
+    LARGE_INTEGER t;
+
+    nxOnce(&gClockOnce, &nxClockInit);
+    QueryPerformanceCounter(&t);
+    return (nxFloat)t.QuadPart / (nxFloat)gClockFrequency.QuadPart;
+}
+
+// Set the context's waitable timer to fire after wait seconds, and return it.  Returns 0 if there is no timer.
+NxInternal HANDLE nxTimerSet(Next N, nxFloat wait)
+{
+    if (!N->sleepTimer)
+    {
+        // High resolution timers need Windows 10 1803, otherwise use a normal one
+        N->sleepTimer = CreateWaitableTimerExA(0, 0, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+        if (!N->sleepTimer) N->sleepTimer = CreateWaitableTimerA(0, TRUE, 0);
+    }
+
+    if (N->sleepTimer)
+    {
+        // Relative time in 100ns units
+        LARGE_INTEGER due;
+        due.QuadPart = -(LONGLONG)(wait * 10000000.0);
+        SetWaitableTimer(N->sleepTimer, &due, 0, 0, 0, FALSE);
+    }
+
+    return N->sleepTimer;
+}
+
+NxInternal void nxSleepUntil(Next N, nxFloat deadline)
+{
+    nxFloat wait = deadline - nxClock();
+    if (wait <= 0) return;
+
+    HANDLE timer = nxTimerSet(N, wait);
+    if (timer)
+    {
+        WaitForSingleObject(timer, INFINITE);
+    }
+    else
+    {
+        Sleep((DWORD)(wait * 1000.0));
+    }
+}
+
+NxInternal void nxSleepDone(Next N)
+{
+    if (N->sleepTimer) CloseHandle(N->sleepTimer);
+    N->sleepTimer = 0;
+}
+
+#else
+
+// Seconds since an arbitrary point.
+NxInternal nxFloat nxClock()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (nxFloat)t.tv_sec + (nxFloat)t.tv_nsec * 1e-9;
+}
+
+NxInternal struct timespec nxClockToTimespec(nxFloat t)
+{
+    struct timespec ts;
+    ts.tv_sec = (time_t)t;
+    ts.tv_nsec = (long)((t - (nxFloat)ts.tv_sec) * 1e9);
+    return ts;
+}
+
+NxInternal void nxSleepUntil(Next N, nxFloat deadline)
+{
+    if (deadline <= nxClock()) return;
+
+    // Absolute, so being woken early by a signal just sleeps again
+    struct timespec t = nxClockToTimespec(deadline);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, 0) == EINTR) {}
+}
+
+NxInternal void nxSleepDone(Next N)
+{
+    if (N->timerFd >= 0) close(N->timerFd);
+    N->timerFd = -1;
+}
+
+#endif // _WIN32
+
+//----------------------------------------------------------------------------------------------------------------------
+// Windows operations
+//----------------------------------------------------------------------------------------------------------------------
+
+#ifdef NX_WINDOW_WIN32
+
+struct _WindowInfo
+{
+    Next            N;
+    HWND            handle;
+    int             imageWidth;
+    int             imageHeight;
+    int             windowWidth;
+    int             windowHeight;
+};
+
+ATOM gWindowClassAtom = 0;
+
+NxInternal NxWindow nxWin32AllocHandle()
+{
+    for (int i = 0; i < nxArrayCount(gWindows); ++i)
+    {
+        if (gWindows[i]->handle == 0) return i;
+    }
+
+    return nxWindowAdd(sizeof(WindowInfo));
+}
+
+NxInternal NxWindow nxWin32FindHandle(HWND wnd)
+{
+    nxInt count = nxArrayCount(gWindows);
+    for (int i = 0; i < count; ++i)
+    {
+        if (gWindows[i]->handle == wnd) return i;
+    }
+
+    return -1;
+}
+
+typedef struct WindowCreateInfo
+{
+    NxWindow handle;
+}
+WindowCreateInfo;
+
+// Copy an image zoomed by scale to the window.  The image is already the size of the window unless the user has
+// resized it, so this is normally a straight copy.
+NxInternal void nxWin32Blit(WindowInfo* info, HDC dc, const nxDword* image, int scale)
+{
+    BITMAPINFO bmi;
+    ZeroMemory(&bmi, sizeof(bmi));
+    bmi.bmiHeader.biSize = sizeof(bmi.bmiHeader);
+    bmi.bmiHeader.biWidth = info->imageWidth * scale;
+    bmi.bmiHeader.biHeight = -info->imageHeight * scale;
+    bmi.bmiHeader.biPlanes = 1;
+    bmi.bmiHeader.biBitCount = 32;
+    bmi.bmiHeader.biCompression = BI_RGB;
+
+    StretchDIBits(dc,
+        0, 0, info->windowWidth, info->windowHeight,
+        0, 0, info->imageWidth * scale, info->imageHeight * scale,
+        image, &bmi,
+        DIB_RGB_COLORS, SRCCOPY);
+}
+
+void nxWin32Lock();
+void nxWin32Unlock();
+void nxWin32CloseWindow(NxWindow window);
+NxWindow nxWin32MakeWindow(const char* title, Next N, int scale);
+
+NxInternal LRESULT CALLBACK nxWin32WindowProc(HWND wnd, UINT msg, WPARAM w, LPARAM l)
+{
+    if (msg == WM_CREATE)
+    {
+        CREATESTRUCTA* cs = (CREATESTRUCTA *)l;
+        WindowCreateInfo* wci = (WindowCreateInfo *)cs->lpCreateParams;
+        nxWindowInfo(wci->handle)->handle = wnd;
+    }
+    else
+    {
+        NxWindow window = nxWin32FindHandle(wnd);
+        WindowInfo* info = (window == -1 ? 0 : nxWindowInfo(window));
+
+        switch (msg)
+        {
+        case WM_SIZE:
+            if (info)
+            {
+                info->windowWidth = LOWORD(l);
+                info->windowHeight = HIWORD(l);
+            }
+            break;
+
+        case WM_PAINT:
+            if (info && info->N->presenter)
+            {
+                // The render thread draws the window
+                PAINTSTRUCT ps;
+                BeginPaint(wnd, &ps);
+                EndPaint(wnd, &ps);
+                nxPresenterRepaint(info->N->presenter);
+            }
+            else if (info)
+            {
+                nxRender(info->N);
+                PAINTSTRUCT ps;
+                HDC dc = BeginPaint(wnd, &ps);
+                nxWin32Blit(info, dc, nxScaleNext(info->N), info->N->scale);
+                EndPaint(wnd, &ps);
+            }
+            break;
+
+        case WM_CLOSE:
+            DestroyWindow(wnd);
+            break;
+
+        case WM_DESTROY:
+            if (--gWindowRefCount == 0)
+            {
+                PostQuitMessage(0);
+            }
+            info->handle = INVALID_HANDLE_VALUE;
+            break;
+
+        case WM_KEYDOWN:
+            {
+                int scale = 0;
+                switch (w)
+                {
+                case VK_ESCAPE:
+                    PostMessageA(wnd, WM_CLOSE, 0, 0);
+                    break;
+
+                case VK_F1:     scale = 1;      break;
+                case VK_F2:     scale = 2;      break;
+                case VK_F3:     scale = 3;      break;
+                case VK_F4:     scale = 4;      break;
+                }
+
+                if (scale && info)
+                {
+                    nxSetOption(info->N, NX_OPTION_SCALE, scale);
+                }
+            }
+            break;
+
+        default:
+            return DefWindowProcA(wnd, msg, w, l);
+        }
+    }
+
+    return 0;
+}
+
+NxWindow nxWin32MakeWindow(const char* title, Next N, int scale)
+{
+    WindowCreateInfo wci;
+    NxWindow w = nxWin32AllocHandle();
+    int width = NX_WINDOW_WIDTH;
+    int height = NX_WINDOW_HEIGHT;
+    nxDword* img = N->image;
+    WindowInfo* info = nxWindowInfo(w);
+
+    nxMemoryClear(info, sizeof(WindowInfo));
+
+    wci.handle = w;
+
+    info->N = N;
+    info->handle = 0;
+    info->imageWidth = width;
+    info->imageHeight = height;
+    info->windowWidth = width * scale;
+    info->windowHeight = height * scale;
+
+    RECT r = { 0, 0, width * scale, height * scale };
+    int style = WS_OVERLAPPED | WS_CAPTION | WS_SYSMENU | WS_VISIBLE;
+
+    if (!gWindowClassAtom)
+    {
+        WNDCLASSEXA wc = { 0 };
+
+        wc.cbSize = sizeof(WNDCLASSEXA);
+        wc.style = CS_HREDRAW | CS_VREDRAW;
+        wc.lpfnWndProc = &nxWin32WindowProc;
+        wc.hInstance = GetModuleHandleA(0);
+        wc.hIcon = wc.hIconSm = LoadIconA(0, IDI_APPLICATION);
+        wc.hCursor = LoadCursorA(0, IDC_ARROW);
+        wc.hbrBackground = (HBRUSH)GetStockObject(BLACK_BRUSH);
+        wc.lpszClassName = "k_bitmap_window";
+
+        gWindowClassAtom = RegisterClassExA(&wc);
+    }
+
+    AdjustWindowRect(&r, style, FALSE);
+
+    info->handle = CreateWindowA("k_bitmap_window", title, style,
+        CW_USEDEFAULT, CW_USEDEFAULT,
+        r.right - r.left, r.bottom - r.top,
+        0, 0, GetModuleHandleA(0), &wci);
+
+    ++gWindowRefCount;
+
+    return w;
+}
+
+void nxWin32ScaleWindow(NxWindow window, int scale)
+{
+    WindowInfo* info = nxWindowInfo(window);
+    HWND wnd = info->handle;
+    int wndWidth = info->imageWidth * scale;
+    int wndHeight = info->imageHeight * scale;
+    info->windowWidth = wndWidth;
+    info->windowHeight = wndHeight;
+
+    RECT r = { 0, 0, wndWidth, wndHeight };
+    DWORD style = GetWindowLongA(wnd, GWL_STYLE);
+    DWORD exStyle = GetWindowLongA(wnd, GWL_EXSTYLE);
+    AdjustWindowRectEx(&r, style, FALSE, exStyle);
+
+    SetWindowPos(wnd, 0, 0, 0, r.right - r.left, r.bottom - r.top,
+        SWP_NOMOVE | SWP_NOZORDER);
+}
+
+void nxWin32CloseWindow(NxWindow window)
+{
+    SendMessageA(nxWindowInfo(window)->handle, WM_CLOSE, 0, 0);
+}
+
+// Wait until the deadline, or until there are messages to handle.
+void nxWin32Wait(Next N, nxFloat deadline)
+{
+    nxFloat wait = deadline - nxClock();
+    if (wait <= 0) return;
+
+    HANDLE timer = nxTimerSet(N, wait);
+    if (timer)
+    {
+        MsgWaitForMultipleObjectsEx(1, &timer, INFINITE, QS_ALLINPUT, MWMO_INPUTAVAILABLE);
+    }
+    else
+    {
+        MsgWaitForMultipleObjectsEx(0, 0, (DWORD)(wait * 1000.0) + 1, QS_ALLINPUT, MWMO_INPUTAVAILABLE);
+    }
+}
+
+nxBool nxWin32Pump()
+{
+    nxBool cont = NX_YES;
+    MSG msg;
+
+    while (PeekMessageA(&msg, 0, 0, 0, PM_NOREMOVE))
+    {
+        if (!GetMessageA(&msg, 0, 0, 0)) cont = NX_NO;
+        TranslateMessage(&msg);
+        DispatchMessageA(&msg);
+    }
+
+    return cont;
+}
+
+void nxWin32Lock()
+{
+    ++gWindowRefCount;
+}
+
+void nxWin32Unlock()
+{
+    --gWindowRefCount;
+}
+
+void nxWin32Redraw(NxWindow window)
+{
+    InvalidateRect(nxWindowInfo(window)->handle, 0, FALSE);
+}
+
+// Called from the render thread in NX_RENDER_MODE_THREADED.
+void nxWin32Present(NxWindow window, const nxDword* image, int scale)
+{
+    WindowInfo* info = nxWindowInfo(window);
+    if (info->handle == INVALID_HANDLE_VALUE) return;
+
+    HDC dc = GetDC(info->handle);
+    nxWin32Blit(info, dc, image, scale);
+    ReleaseDC(info->handle, dc);
+}
+
+#endif // NX_WINDOW_WIN32
+
+//----------------------------------------------------------------------------------------------------------------------
+// X11 operations
+//
+// Every window shares one display connection.  The image is copied into an XImage the size of the zoomed image, which
+// lives in a MIT-SHM shared memory segment when the server supports it so that presenting does not send the pixels
+// down the socket.  Remote displays cannot share memory, so they fall back to XPutImage.  Xlib is initialised for
+// threads, and each window has a lock, because the render thread presents in NX_RENDER_MODE_THREADED.
+//----------------------------------------------------------------------------------------------------------------------
+
+#ifdef NX_WINDOW_X11
+
+struct _WindowInfo
+{
+    Next            N;
+    Window          handle;
+    GC              gc;
+    NxMutex         lock;           // Guards the XImage and open while presenting
+    nxBool          open;
+    nxBool          redraw;         // Paint on the next pump
+
+    XImage*         image;
+    XShmSegmentInfo shm;
+    nxBool          useShm;
+    int             scale;          // Scale the XImage was made for
+
+    int             imageWidth;
+    int             imageHeight;
+    int             windowWidth;
+    int             windowHeight;
+};
+
+Display* gX11Display = 0;
+Atom gX11DeleteWindow;
+nxBool gX11ShmError = NX_NO;
+nxBool gX11ShmFailed = NX_NO;       // Attaching has failed once, so don't try again
+
+NxInternal NxWindow nxX11AllocHandle()
+{
+    for (int i = 0; i < nxArrayCount(gWindows); ++i)
+    {
+        if (gWindows[i]->N == 0) return i;
+    }
+
+    return nxWindowAdd(sizeof(WindowInfo));
+}
+
+NxInternal NxWindow nxX11FindHandle(Window wnd)
+{
+    nxInt count = nxArrayCount(gWindows);
+    for (int i = 0; i < count; ++i)
+    {
+        if (gWindows[i]->N && gWindows[i]->handle == wnd) return i;
+    }
+
+    return -1;
+}
+
+NxInternal int nxX11HandleShmError(Display* display, XErrorEvent* error)
+{
+    gX11ShmError = NX_YES;
+    return 0;
+}
+
+NxInternal void nxX11FreeImage(WindowInfo* info)
+{
+    if (!info->image) return;
+
+    if (info->useShm)
+    {
+        XShmDetach(gX11Display, &info->shm);
+        XDestroyImage(info->image);
+        shmdt(info->shm.shmaddr);
+    }
+    else
+    {
+        XDestroyImage(info->image);
+    }
+    info->image = 0;
+}
+
+// Make an XImage for the image zoomed by scale, in shared memory if possible.  Call with the window locked.
+NxInternal nxBool nxX11MakeImage(WindowInfo* info, int scale)
+{
+    int width = info->imageWidth * scale;
+    int height = info->imageHeight * scale;
+    int screen = DefaultScreen(gX11Display);
+    Visual* visual = DefaultVisual(gX11Display, screen);
+    int depth = DefaultDepth(gX11Display, screen);
+
+    nxX11FreeImage(info);
+    info->useShm = NX_NO;
+
+    if (!gX11ShmFailed && XShmQueryExtension(gX11Display))
+    {
+        info->image = XShmCreateImage(gX11Display, visual, depth, ZPixmap, 0, &info->shm, width, height);
+        if (info->image)
+        {
+            info->shm.shmid = shmget(IPC_PRIVATE, info->image->bytes_per_line * height, IPC_CREAT | 0600);
+            info->shm.shmaddr = info->shm.shmid == -1 ? (char *)-1 : (char *)shmat(info->shm.shmid, 0, 0);
+            if (info->shm.shmaddr != (char *)-1)
+            {
+                info->image->data = info->shm.shmaddr;
+                info->shm.readOnly = False;
+
+                // Attaching fails with an X error on remote displays, so catch it rather than exit
+                gX11ShmError = NX_NO;
+                XErrorHandler oldHandler = XSetErrorHandler(&nxX11HandleShmError);
+                XShmAttach(gX11Display, &info->shm);
+                XSync(gX11Display, False);
+                XSetErrorHandler(oldHandler);
+
+                info->useShm = !gX11ShmError;
+                gX11ShmFailed = gX11ShmError;
+                if (!info->useShm) shmdt(info->shm.shmaddr);
+            }
+
+            // The segment is freed when both sides detach
+            if (info->shm.shmid != -1) shmctl(info->shm.shmid, IPC_RMID, 0);
+
+            if (!info->useShm)
+            {
+                info->image->data = 0;
+                XDestroyImage(info->image);
+                info->image = 0;
+            }
+        }
+    }
+
+    if (!info->useShm)
+    {
+        char* data = (char *)malloc(sizeof(nxDword) * width * height);
+        info->image = data ? XCreateImage(gX11Display, visual, depth, ZPixmap, 0, data, width, height, 32, 0) : 0;
+        if (!info->image)
+        {
+            free(data);
+            return NX_NO;
+        }
+    }
+
+    // Pixels are copied straight in as 32-bit ARGB
+    if (info->image->bits_per_pixel != 32 || info->image->bytes_per_line != width * (int)sizeof(nxDword))
+    {
+        nxX11FreeImage(info);
+        return NX_NO;
+    }
+
+    info->scale = scale;
+    return NX_YES;
+}
+
+// Show the XImage.  Call with the window locked.
+NxInternal void nxX11PutImage(WindowInfo* info)
+{
+    if (info->useShm)
+    {
+        // Wait for the server to finish reading the shared memory before it is written again
+        XShmPutImage(gX11Display, info->handle, info->gc, info->image, 0, 0, 0, 0,
+            info->image->width, info->image->height, False);
+        XSync(gX11Display, False);
+    }
+    else
+    {
+        XPutImage(gX11Display, info->handle, info->gc, info->image, 0, 0, 0, 0,
+            info->image->width, info->image->height);
+        XFlush(gX11Display);
+    }
+}
+
+// Render the context and show it, scaling it straight into the XImage.
+NxInternal void nxX11Paint(WindowInfo* info)
+{
+    Next N = info->N;
+    nxRender(N);
+
+    nxMutexLock(&info->lock);
+    if (info->open && (info->scale == N->scale || nxX11MakeImage(info, N->scale)))
+    {
+        nxScaleImage(N->image, (nxDword *)info->image->data, N->scale, N->renderPath);
+        nxX11PutImage(info);
+    }
+    nxMutexUnlock(&info->lock);
+}
+
+NxInternal void nxX11SetSize(WindowInfo* info, int scale)
+{
+    int width = info->imageWidth * scale;
+    int height = info->imageHeight * scale;
+
+    // Fixed size, like the Win32 window
+    XSizeHints* hints = XAllocSizeHints();
+    hints->flags = PMinSize | PMaxSize;
+    hints->min_width = hints->max_width = width;
+    hints->min_height = hints->max_height = height;
+    XSetWMNormalHints(gX11Display, info->handle, hints);
+    XFree(hints);
+
+    XResizeWindow(gX11Display, info->handle, width, height);
+    info->windowWidth = width;
+    info->windowHeight = height;
+}
+
+NxWindow nxX11MakeWindow(const char* title, Next N, int scale)
+{
+    if (!gX11Display)
+    {
+        XInitThreads();
+        gX11Display = XOpenDisplay(0);
+        if (!gX11Display) return -1;
+        gX11DeleteWindow = XInternAtom(gX11Display, "WM_DELETE_WINDOW", False);
+    }
+
+    NxWindow w = nxX11AllocHandle();
+    WindowInfo* info = nxWindowInfo(w);
+    int screen = DefaultScreen(gX11Display);
+
+    nxMemoryClear(info, sizeof(WindowInfo));
+    info->N = N;
+    info->imageWidth = NX_WINDOW_WIDTH;
+    info->imageHeight = NX_WINDOW_HEIGHT;
+    info->windowWidth = NX_WINDOW_WIDTH * scale;
+    info->windowHeight = NX_WINDOW_HEIGHT * scale;
+    nxMutexInit(&info->lock);
+
+    info->handle = XCreateSimpleWindow(gX11Display, RootWindow(gX11Display, screen), 0, 0,
+        info->windowWidth, info->windowHeight, 0, BlackPixel(gX11Display, screen), BlackPixel(gX11Display, screen));
+    info->gc = XCreateGC(gX11Display, info->handle, 0, 0);
+
+    if (!nxX11MakeImage(info, scale))
+    {
+        XFreeGC(gX11Display, info->gc);
+        XDestroyWindow(gX11Display, info->handle);
+        nxMutexDone(&info->lock);
+        info->N = 0;
+        return -1;
+    }
+
+    XStoreName(gX11Display, info->handle, title);
+    XSelectInput(gX11Display, info->handle, ExposureMask | KeyPressMask | StructureNotifyMask);
+    XSetWMProtocols(gX11Display, info->handle, &gX11DeleteWindow, 1);
+    nxX11SetSize(info, scale);
+    XMapWindow(gX11Display, info->handle);
+    XFlush(gX11Display);
+
+    info->open = NX_YES;
+    ++gWindowRefCount;
+
+    return w;
+}
+
+// Close the window.  The slot stays allocated to the context until nxX11FreeWindow.
+void nxX11CloseWindow(NxWindow window)
+{
+    WindowInfo* info = nxWindowInfo(window);
+
+    nxMutexLock(&info->lock);
+    if (info->open)
+    {
+        info->open = NX_NO;
+        nxX11FreeImage(info);
+        XFreeGC(gX11Display, info->gc);
+        XDestroyWindow(gX11Display, info->handle);
+        XFlush(gX11Display);
+        if (--gWindowRefCount == 0)
+        {
+            // That was the last window, so disconnect.  nxX11Pump then returns NX_NO, and the next window reconnects.
+            XCloseDisplay(gX11Display);
+            gX11Display = 0;
+        }
+    }
+    nxMutexUnlock(&info->lock);
+}
+
+void nxX11FreeWindow(NxWindow window)
+{
+    nxX11CloseWindow(window);
+    WindowInfo* info = nxWindowInfo(window);
+    nxMutexDone(&info->lock);
+    info->N = 0;
+}
+
+void nxX11ScaleWindow(NxWindow window, int scale)
+{
+    WindowInfo* info = nxWindowInfo(window);
+    if (info->open) nxX11SetSize(info, scale);
+}
+
+void nxX11Redraw(NxWindow window)
+{
+    nxWindowInfo(window)->redraw = NX_YES;
+}
+
+// Called from the render thread in NX_RENDER_MODE_THREADED.
+void nxX11Present(NxWindow window, const nxDword* image, int scale)
+{
+    WindowInfo* info = nxWindowInfo(window);
+
+    nxMutexLock(&info->lock);
+    if (info->open && (info->scale == scale || nxX11MakeImage(info, scale)))
+    {
+        nxMemoryCopy(image, info->image->data, sizeof(nxDword) * info->image->width * info->image->height);
+        nxX11PutImage(info);
+    }
+    nxMutexUnlock(&info->lock);
+}
+
+// Wait until the deadline, or until there are events to handle.  On Linux, a timerfd wakes poll() at the deadline
+// exactly; elsewhere the poll timeout is rounded up to the next millisecond.
+void nxX11Wait(Next N, nxFloat deadline)
+{
+    if (!gX11Display)
+    {
+        nxSleepUntil(N, deadline);
+        return;
+    }
+
+    nxFloat wait = deadline - nxClock();
+    if (wait <= 0 || XPending(gX11Display)) return;
+
+    struct pollfd fds[2];
+    int numFds = 0;
+    int timeout = (int)(wait * 1000.0) + 1;
+
+    fds[numFds].fd = ConnectionNumber(gX11Display);
+    fds[numFds].events = POLLIN;
+    ++numFds;
+
+#ifdef __linux__
+    if (N->timerFd < 0) N->timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (N->timerFd >= 0)
+    {
+        struct itimerspec ts = { 0 };
+        ts.it_value = nxClockToTimespec(deadline);
+        timerfd_settime(N->timerFd, TFD_TIMER_ABSTIME, &ts, 0);
+
+        fds[numFds].fd = N->timerFd;
+        fds[numFds].events = POLLIN;
+        ++numFds;
+        timeout = -1;
+    }
+#endif
+
+    while (poll(fds, numFds, timeout) < 0 && errno == EINTR) {}
+
+#ifdef __linux__
+    if (N->timerFd >= 0)
+    {
+        // Disarm it and clear any expiry
+        nxQword expiries;
+        struct itimerspec ts = { 0 };
+        timerfd_settime(N->timerFd, 0, &ts, 0);
+        while (read(N->timerFd, &expiries, sizeof(expiries)) > 0) {}
+    }
+#endif
+}
+
+nxBool nxX11Pump()
+{
+    if (!gX11Display) return NX_NO;
+
+    // Closing the last window disconnects, so stop once the display has gone
+    while (gX11Display && XPending(gX11Display))
+    {
+        XEvent ev;
+        XNextEvent(gX11Display, &ev);
+
+        NxWindow window = nxX11FindHandle(ev.xany.window);
+        if (window == -1) continue;
+        WindowInfo* info = nxWindowInfo(window);
+
+        switch (ev.type)
+        {
+        case Expose:
+            if (ev.xexpose.count == 0)
+            {
+                if (info->N->presenter)
+                {
+                    // The render thread draws the window
+                    nxPresenterRepaint(info->N->presenter);
+                }
+                else
+                {
+                    info->redraw = NX_YES;
+                }
+            }
+            break;
+
+        case ConfigureNotify:
+            info->windowWidth = ev.xconfigure.width;
+            info->windowHeight = ev.xconfigure.height;
+            break;
+
+        case ClientMessage:
+            if ((Atom)ev.xclient.data.l[0] == gX11DeleteWindow)
+            {
+                nxX11CloseWindow(window);
+            }
+            break;
+
+        case KeyPress:
+            {
+                int scale = 0;
+                switch (XLookupKeysym(&ev.xkey, 0))
+                {
+                case XK_Escape:
+                    nxX11CloseWindow(window);
+                    break;
+
+                case XK_F1:     scale = 1;      break;
+                case XK_F2:     scale = 2;      break;
+                case XK_F3:     scale = 3;      break;
+                case XK_F4:     scale = 4;      break;
+                }
+
+                if (scale)
+                {
+                    nxSetOption(info->N, NX_OPTION_SCALE, scale);
+                }
+            }
+            break;
+        }
+    }
+
+    // Paint the windows that asked for it, like WM_PAINT does on Windows
+    nxInt count = nxArrayCount(gWindows);
+    for (int i = 0; i < count; ++i)
+    {
+        WindowInfo* info = gWindows[i];
+        if (info->N && info->open && info->redraw && !info->N->presenter)
+        {
+            info->redraw = NX_NO;
+            nxX11Paint(info);
+        }
+    }
+
+    return gX11Display != 0;
+}
+
+#endif // NX_WINDOW_X11
+
+//----------------------------------------------------------------------------------------------------------------------
+// Window backend
+//
+// Dispatches to the platform's window code.  Headless contexts have no window: redraws are remembered until nxUpdate
+// or nxFrameBuffer renders the image.
+//----------------------------------------------------------------------------------------------------------------------
+
+NxInternal void nxWindowOpen(Next N, const char* title, int scale)
+{
+    N->window = -1;
+    if (N->headless) return;
+
+#if NX_WINDOW_WIN32
+    N->window = nxWin32MakeWindow(title, N, scale);
+#elif NX_WINDOW_X11
+    N->window = nxX11MakeWindow(title, N, scale);
+#endif
+
+    // Carry on without a window if it could not be opened
+    if (N->window == -1) N->headless = NX_YES;
+}
+
+NxInternal void nxWindowClose(Next N)
+{
+#if NX_WINDOW_WIN32
+    if (!N->headless && nxWindowInfo(N->window)->handle != INVALID_HANDLE_VALUE)
+    {
+        nxWin32CloseWindow(N->window);
+    }
+#elif NX_WINDOW_X11
+    if (!N->headless) nxX11FreeWindow(N->window);
+#endif
+}
+
+// Ask the window to repaint.
+NxInternal void nxWindowInvalidate(Next N)
+{
+    if (N->headless) return;
+    N->redrawPending = NX_NO;
+
+#if NX_WINDOW_WIN32
+    nxWin32Redraw(N->window);
+#elif NX_WINDOW_X11
+    nxX11Redraw(N->window);
+#endif
+}
+
+NxInternal void nxWindowRedraw(Next N)
+{
+    // When frames are run back to back, redraws wait for the next frame that is shown
+    if (N->headless || N->turbo || N->batch)
+    {
+        N->redrawPending = NX_YES;
+        return;
+    }
+
+    nxWindowInvalidate(N);
+}
+
+NxInternal void nxWindowPresent(Next N, const nxDword* image, int scale)
+{
+#if NX_WINDOW_WIN32
+    if (!N->headless) nxWin32Present(N->window, image, scale);
+#elif NX_WINDOW_X11
+    if (!N->headless) nxX11Present(N->window, image, scale);
+#endif
+}
+
+NxInternal void nxWindowScale(Next N)
+{
+#if NX_WINDOW_WIN32
+    if (!N->headless) nxWin32ScaleWindow(N->window, N->scale);
+#elif NX_WINDOW_X11
+    if (!N->headless) nxX11ScaleWindow(N->window, N->scale);
+#endif
+}
+
+// Wait until the deadline, or until the window has events to handle, whichever comes first.
+NxInternal void nxWindowWait(Next N, nxFloat deadline)
+{
+#if NX_WINDOW_WIN32
+    nxWin32Wait(N, deadline);
+#elif NX_WINDOW_X11
+    nxX11Wait(N, deadline);
+#else
+    nxSleepUntil(N, deadline);
+#endif
+}
+
+NxInternal nxBool nxWindowPump()
+{
+#if NX_WINDOW_WIN32
+    return nxWin32Pump();
+#elif NX_WINDOW_X11
+    return nxX11Pump();
+#else
+    return NX_YES;
+#endif
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// File operations
+//----------------------------------------------------------------------------------------------------------------------
+
+#ifdef _WIN32
+
+void nxDataUnload(NxData* d)
+{
+    if (d->bytes)       UnmapViewOfFile(d->bytes);
+    if (d->fileMap)     CloseHandle(d->fileMap);
+    if (d->file)        CloseHandle(d->file);
+
+    d->bytes = 0;
+    d->size = 0;
+    d->file = 0;
+    d->fileMap = 0;
+}
+
+NxData nxDataLoad(const char* fileName)
+{
+    NxData d = { 0 };
+
+    HANDLE file = CreateFileA(fileName, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, 0);
+    if (file != INVALID_HANDLE_VALUE)
+    {
+        d.file = file;
+
+        DWORD fileSizeHigh, fileSizeLow;
+        fileSizeLow = GetFileSize(d.file, &fileSizeHigh);
+        d.fileMap = CreateFileMappingA(d.file, 0, PAGE_READONLY, fileSizeHigh, fileSizeLow, 0);
+
+        if (d.fileMap)
+        {
+            d.bytes = MapViewOfFile(d.fileMap, FILE_MAP_READ, 0, 0, 0);
+            d.size = ((nxInt)fileSizeHigh << 32) | fileSizeLow;
+        }
+        else
+        {
+            nxDataUnload(&d);
+        }
+    }
+
+    return d;
+}
+
+NxData nxDataMake(const char* fileName, nxInt size)
+{
+    NxData d = { 0 };
+
+    HANDLE file = CreateFileA(fileName, GENERIC_READ | GENERIC_WRITE, 0, 0, CREATE_ALWAYS, 0, 0);
+    if (file != INVALID_HANDLE_VALUE)
+    {
+        d.file = file;
+
+        DWORD fileSizeLow = (size & 0xffffffff);
+        DWORD fileSizeHigh = (size >> 32);
+        d.fileMap = CreateFileMappingA(d.file, 0, PAGE_READWRITE, fileSizeHigh, fileSizeLow, 0);
+
+        if (d.fileMap)
+        {
+            d.bytes = MapViewOfFile(d.fileMap, FILE_MAP_WRITE, 0, 0, 0);
+            d.size = size;
+        }
+        else
+        {
+            nxDataUnload(&d);
+        }
+    }
+
+    return d;
+}
+
+#else
+
+// The mapping outlives the file descriptor, so the descriptor is closed as soon as the file is mapped and
+// NxData.file and NxData.fileMap are unused.  Every user of these routines streams through the whole file once, so
+// loads are pre-faulted and read ahead, and both are marked as sequential so pages behind the reader can be dropped.
+
+void nxDataUnload(NxData* d)
+{
+    if (d->bytes) munmap(d->bytes, (size_t)d->size);
+
+    d->bytes = 0;
+    d->size = 0;
+    d->file = 0;
+    d->fileMap = 0;
+}
+
+NxData nxDataLoad(const char* fileName)
+{
+    NxData d = { 0 };
+
+    int fd = open(fileName, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0)
+    {
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0)
+        {
+            int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+            flags |= MAP_POPULATE;
+#endif
+            void* bytes = mmap(0, (size_t)st.st_size, PROT_READ, flags, fd, 0);
+            if (bytes != MAP_FAILED)
+            {
+                madvise(bytes, (size_t)st.st_size, MADV_SEQUENTIAL);
+                madvise(bytes, (size_t)st.st_size, MADV_WILLNEED);
+                d.bytes = (nxByte *)bytes;
+                d.size = (nxInt)st.st_size;
+            }
+        }
+        close(fd);
+    }
+
+    return d;
+}
+
+NxData nxDataMake(const char* fileName, nxInt size)
+{
+    NxData d = { 0 };
+
+    int fd = open(fileName, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd >= 0)
+    {
+        if (size > 0 && ftruncate(fd, (off_t)size) == 0)
+        {
+            void* bytes = mmap(0, (size_t)size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (bytes != MAP_FAILED)
+            {
+                madvise(bytes, (size_t)size, MADV_SEQUENTIAL);
+                d.bytes = (nxByte *)bytes;
+                d.size = size;
+            }
+        }
+        close(fd);
+    }
+
+    return d;
+}
+
+#endif // _WIN32
+
+//
+// Streams
+//
+// The window always starts on a multiple of the mapping granularity, so it may begin a little before the cursor.  A
+// window is only remapped when a read runs off its end, or the cursor is moved outside it.
+//
+
+#define NX_STREAM_DEFAULT_WINDOW    (16 * 1024 * 1024)
+
+struct _NxStream
+{
+    nxInt               size;                       // Length of the file
+    nxInt               pos;                        // Cursor
+    nxInt               windowSize;
+    nxInt               granularity;                // Window starts are multiples of this
+    nxByte*             window;                     // Mapped bytes, or 0
+    nxInt               windowStart;                // File offset of window[0]
+    nxInt               windowLength;
+    nxBool              readAhead;                  // The window after this one has been read ahead
+#ifdef _WIN32
+    HANDLE              file;
+    HANDLE              fileMap;
+    nxByte*             ahead;                      // The next window, mapped early to read it ahead, or 0
+    nxInt               aheadStart;
+    nxInt               aheadLength;
+#else
+    int                 fd;
+#endif
+};
+
+#ifdef _WIN32
+
+NxInternal nxBool nxStreamOpenFile(NxStream S, const char* fileName)
+{
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    S->granularity = info.dwAllocationGranularity;
+
+    S->file = CreateFileA(fileName, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+    if (S->file == INVALID_HANDLE_VALUE) return NX_NO;
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(S->file, &size)) return NX_NO;
+    S->size = size.QuadPart;
+
+    // Mapping the whole file only reserves the section, not address space
+    S->fileMap = S->size ? CreateFileMappingA(S->file, 0, PAGE_READONLY, 0, 0, 0) : 0;
+    return NX_AS_BOOL(S->fileMap || !S->size);
+}
+
+NxInternal void nxStreamCloseFile(NxStream S)
+{
+    if (S->ahead) UnmapViewOfFile(S->ahead);
+    if (S->fileMap) CloseHandle(S->fileMap);
+    if (S->file != INVALID_HANDLE_VALUE) CloseHandle(S->file);
+}
+
+NxInternal nxByte* nxStreamMapView(NxStream S, nxInt start, nxInt length)
+{
+    if (S->ahead)
+    {
+        // Use the view that was read ahead if it is the one wanted.  Otherwise drop it: its pages stay cached for
+        // whichever view of the file maps them.
+        nxByte* bytes = S->ahead;
+        S->ahead = 0;
+        if (start == S->aheadStart && length == S->aheadLength) return bytes;
+        UnmapViewOfFile(bytes);
+    }
+
+    return (nxByte *)MapViewOfFile(S->fileMap, FILE_MAP_READ, (DWORD)(start >> 32), (DWORD)(start & 0xffffffff),
+                                   (SIZE_T)length);
+}
+
+NxInternal void nxStreamUnmapView(NxStream S)
+{
+    UnmapViewOfFile(S->window);
+}
+
+// PrefetchVirtualMemory and its range type are only declared when targeting Windows 8 or later.
+typedef struct
+{
+    void*               address;
+    SIZE_T              size;
+}
+NxPrefetchRange;
+
+typedef BOOL (WINAPI *NxPrefetchFunc)(HANDLE process, ULONG_PTR numRanges, NxPrefetchRange* ranges, ULONG flags);
+
+// Mapped views have no equivalent of POSIX_FADV_WILLNEED, so map the next window now and ask for its pages to be read
+// in.  Before Windows 8 there is no PrefetchVirtualMemory, and the view is only mapped early.
+NxInternal void nxStreamReadAhead(NxStream S, nxInt start, nxInt length)
+{
+    // Map the view nxStreamMap will ask for when the cursor gets to start, which a grown window may not end on
+    start -= start % S->granularity;
+    length = NX_MIN(S->windowSize, S->size - start);
+    nxByte* bytes = nxStreamMapView(S, start, length);
+    if (!bytes) return;
+
+    NxPrefetchFunc prefetch = (NxPrefetchFunc)GetProcAddress(GetModuleHandleA("kernel32.dll"), "PrefetchVirtualMemory");
+    if (prefetch)
+    {
+        NxPrefetchRange range = { bytes, (SIZE_T)length };
+        prefetch(GetCurrentProcess(), 1, &range, 0);
+    }
+
+    S->ahead = bytes;
+    S->aheadStart = start;
+    S->aheadLength = length;
+}
+
+#else
+
+NxInternal nxBool nxStreamOpenFile(NxStream S, const char* fileName)
+{
+    S->granularity = (nxInt)sysconf(_SC_PAGESIZE);
+
+    S->fd = open(fileName, O_RDONLY | O_CLOEXEC);
+    if (S->fd < 0) return NX_NO;
+
+    struct stat st;
+    if (fstat(S->fd, &st) != 0) return NX_NO;
+    S->size = (nxInt)st.st_size;
+    return NX_YES;
+}
+
+NxInternal void nxStreamCloseFile(NxStream S)
+{
+    if (S->fd >= 0) close(S->fd);
+}
+
+NxInternal nxByte* nxStreamMapView(NxStream S, nxInt start, nxInt length)
+{
+    void* bytes = mmap(0, (size_t)length, PROT_READ, MAP_SHARED, S->fd, (off_t)start);
+    if (bytes == MAP_FAILED) return 0;
+
+    madvise(bytes, (size_t)length, MADV_SEQUENTIAL);
+    return (nxByte *)bytes;
+}
+
+NxInternal void nxStreamUnmapView(NxStream S)
+{
+    munmap(S->window, (size_t)S->windowLength);
+}
+
+NxInternal void nxStreamReadAhead(NxStream S, nxInt start, nxInt length)
+{
+#ifdef POSIX_FADV_WILLNEED
+    posix_fadvise(S->fd, (off_t)start, (off_t)length, POSIX_FADV_WILLNEED);
+#endif
+}
+
+#endif // _WIN32
+
+// Map a window that holds the size bytes at pos.  Returns NX_NO if they are past the end of the file.
+NxInternal nxBool nxStreamMap(NxStream S, nxInt pos, nxInt size)
+{
+    if (pos + size > S->size) return NX_NO;
+    if (S->window && pos >= S->windowStart && pos + size <= S->windowStart + S->windowLength) return NX_YES;
+
+    if (S->window) nxStreamUnmapView(S);
+    S->window = 0;
+
+    // The window grows past its usual size if a single nxStreamNext needs it to
+    nxInt start = pos - pos % S->granularity;
+    nxInt length = NX_MIN(NX_MAX(S->windowSize, pos + size - start), S->size - start);
+    S->window = nxStreamMapView(S, start, length);
+    if (!S->window) return NX_NO;
+
+    S->windowStart = start;
+    S->windowLength = length;
+    S->readAhead = NX_NO;
+    return NX_YES;
+}
+
+// Move the cursor past bytes that have been read, and read the next window ahead once half of this one has gone.
+NxInternal void nxStreamAdvance(NxStream S, nxInt size)
+{
+    S->pos += size;
+
+    nxInt windowEnd = S->windowStart + S->windowLength;
+    if (!S->readAhead && S->pos - S->windowStart >= S->windowLength / 2 && windowEnd < S->size)
+    {
+        nxStreamReadAhead(S, windowEnd, NX_MIN(S->windowSize, S->size - windowEnd));
+        S->readAhead = NX_YES;
+    }
+}
+
+NxStream nxStreamOpen(const char* fileName, nxInt windowSize)
+{
+    NxStream S = (NxStream)NX_ALLOC(sizeof(struct _NxStream));
+    nxMemoryClear(S, sizeof(struct _NxStream));
+#ifdef _WIN32
+    S->file = INVALID_HANDLE_VALUE;
+#else
+    S->fd = -1;
+#endif
+
+    if (!nxStreamOpenFile(S, fileName))
+    {
+        nxStreamCloseFile(S);
+        NX_FREE(S);
+        return 0;
+    }
+
+    if (windowSize <= 0) windowSize = NX_STREAM_DEFAULT_WINDOW;
+    S->windowSize = (windowSize + S->granularity - 1) / S->granularity * S->granularity;
+    return S;
+}
+
+void nxStreamClose(NxStream S)
+{
+    if (!S) return;
+
+    if (S->window) nxStreamUnmapView(S);
+    nxStreamCloseFile(S);
+    NX_FREE(S);
+}
+
+nxInt nxStreamSize(NxStream S)
+{
+    return S->size;
+}
+
+nxInt nxStreamTell(NxStream S)
+{
+    return S->pos;
+}
+
+nxBool nxStreamSeek(NxStream S, nxInt pos)
+{
+    if (pos < 0 || pos > S->size) return NX_NO;
+    S->pos = pos;
+    return NX_YES;
+}
+
+nxInt nxStreamRead(NxStream S, void* buffer, nxInt size)
+{
+    nxByte* out = (nxByte *)buffer;
+    nxInt total = 0;
+
+    size = NX_MIN(size, S->size - S->pos);
+    while (total < size)
+    {
+        if (!nxStreamMap(S, S->pos, 1)) break;
+
+        nxInt offset = S->pos - S->windowStart;
+        nxInt count = NX_MIN(size - total, S->windowLength - offset);
+        nxMemoryCopy(S->window + offset, out + total, count);
+        total += count;
+        nxStreamAdvance(S, count);
+    }
+
+    return total;
+}
+
+const nxByte* nxStreamNext(NxStream S, nxInt size)
+{
+    if (!nxStreamMap(S, S->pos, size)) return 0;
+
+    const nxByte* p = S->window + (S->pos - S->windowStart);
+    nxStreamAdvance(S, size);
+    return p;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Implementation of API
+//----------------------------------------------------------------------------------------------------------------------
+
+// Asynchronous loading, implemented after the file routines it uses
+NxInternal void nxLoadCommitAll(Next N);
+NxInternal void nxLoaderClose(Next N);
+
+NxInternal nxFloat nxTime(Next N)
+{
+    nxFloat t = nxClock();
+    nxFloat secs = t - N->lastTimeStamp;
+    N->lastTimeStamp = t;
+    return secs;
+}
+
+Next nxOpen()
+{
+    return nxOpenEx(0);
+}
+
+Next nxOpenEx(const NxConfig* config)
+{
+    NxConfig defaults = { 0 };
+    if (!config) config = &defaults;
+
+    Next N = NX_ALLOC(sizeof(struct _Next));
+
+    nxMemoryClear(N, sizeof(struct _Next));
+    N->image = NX_ALLOC(sizeof(nxDword) * NX_WINDOW_WIDTH * NX_WINDOW_HEIGHT);
+#if NX_WINDOW_WIN32 || NX_WINDOW_X11
+    N->headless = config->headless;
+#else
+    N->headless = NX_YES;
+#endif
+    N->redrawPending = NX_NO;
+    N->scale = config->scale ? NX_MIN(NX_MAX(config->scale, 1), NX_MAX_SCALE) : NX_MAX_SCALE;
+    N->scaled = 0;
+    nxWindowOpen(N, "ZX Spectrum Next", N->scale);
+    N->flash = NX_NO;
+    N->flashCount = 0;
+    N->lastTimeStamp = nxClock();
+    N->currentTime = 0;
+    N->framePacing = NX_YES;
+    N->turbo = NX_NO;
+    N->batch = NX_NO;
+    N->renderInterval = 1;
+    N->renderCount = 0;
+    N->maxCatchUp = 5;
+    N->catchUpSkipRender = NX_YES;
+    N->sleepTimer = 0;
+    N->timerFd = -1;
+
+    int ramSize = config->ramSize ? NX_MIN(NX_MAX(config->ramSize, 256), NX_MAX_BANKS * 16) : NX_DEFAULT_RAM_SIZE;
+    N->numBanks = (ramSize + 15) / 16;
+
+    static const nxByte kMmuDefault[8] = { 0, 1, 10, 11, 4, 5, 0, 1 };
+    nxMemoryCopy(kMmuDefault, N->mmu, sizeof(N->mmu));
+    memset(N->unmappedRead, 0xff, sizeof(N->unmappedRead));
+    N->page0_2 = 0;
+    N->page3_5 = 0;
+
+    nxPaletteReset(N);
+
+    N->layer2Bank = 0;
+    N->layer2BankStart = 8;
+    N->layer2ShadowBankStart = 11;
+    N->layer2Transparent = 0xe3;
+    N->layer2ShadowEnable = NX_NO;
+    N->layer2Enable = NX_NO;
+    N->layer2Write0 = NX_NO;
+    nxMmuUpdate(N);
+
+    N->nextRegSelect = 0;
+
+    nxOnce(&gUlaTablesOnce, &nxUlaMakeTables);
+    N->renderMode = NX_RENDER_MODE_FRAME;
+    N->renderPath = nxResolveRenderPath(NX_RENDER_AUTO);
+    N->scanline = 0;
+    N->renderThreads = 1;
+    N->renderPool = 0;
+    N->presenter = 0;
+    N->loader = 0;
+    N->loads = 0;
+    N->fleetIndex = -1;
+    N->fleetStop = NX_NO;
+
+    nxFlashRebuild(N);
+    nxDirtyAll(N);
+
+    return N;
+}
+
+void nxClose(Next N)
+{
+    if (N)
+    {
+        nxPresenterClose(N->presenter);
+        nxLoaderClose(N);
+        nxWindowClose(N);
+        nxPoolClose(N->renderPool);
+        nxSleepDone(N);
+        for (int i = 0; i < N->numBanks; ++i) nxBankRelease(N->banks[i]);
+        NX_FREE(N->scaled);
+        NX_FREE(N->image);
+        NX_FREE(N);
+    }
+}
+
+// Run a frame: update the flash state and run the frame routine.
+NxInternal void nxFrameRun(Next N, NxFrameRoutine f)
+{
+    ++N->stats.frames;
+    if (N->loads) nxLoadCommitAll(N);
+
+    if (++N->flashCount == 16)
+    {
+        N->flashCount = 0;
+        N->flash = !N->flash;
+        if (nxDirtyFlash(N)) nxRedraw(N);
+    }
+    if (f)
+    {
+        f(N);
+    }
+}
+
+// Show the frame that has just run when there is no time passing within frames.  Scanline mode renders all the lines
+// with the state at the end of the frame.
+NxInternal void nxFrameShow(Next N)
+{
+    if (N->renderMode == NX_RENDER_MODE_SCANLINE)
+    {
+        N->scanline = 0;
+        nxRenderLinesTo(N, NX_WINDOW_HEIGHT);
+        nxWindowInvalidate(N);
+    }
+    else if (N->presenter)
+    {
+        nxPresenterSubmit(N->presenter);
+    }
+    else
+    {
+        nxRender(N);
+        nxWindowInvalidate(N);
+    }
+    N->redrawPending = NX_NO;
+}
+
+// Run a frame back to back with others, showing it if it is due by the render interval.
+NxInternal void nxFrameStep(Next N, NxFrameRoutine f)
+{
+    nxFrameRun(N, f);
+    if (N->renderInterval && ++N->renderCount >= N->renderInterval)
+    {
+        N->renderCount = 0;
+        nxFrameShow(N);
+    }
+    else if (N->renderMode == NX_RENDER_MODE_SCANLINE)
+    {
+        // None of this frame's lines have been rendered
+        N->scanline = 0;
+    }
+}
+
+// Carry on in real time from now, after running frames without the clock.
+NxInternal void nxClockReset(Next N)
+{
+    N->lastTimeStamp = nxClock();
+    N->currentTime = 0;
+}
+
+nxBool nxRunFrames(Next N, NxFrameRoutine f, int count)
+{
+    nxBool open = NX_YES;
+
+    N->batch = NX_YES;
+    for (int i = 0; i < count && open; ++i)
+    {
+        nxFrameStep(N, f);
+        if (!N->headless) open = nxWindowPump();
+    }
+    N->batch = NX_NO;
+
+    if (N->redrawPending && !N->turbo && !N->headless) nxWindowInvalidate(N);
+    nxClockReset(N);
+
+    return open;
+}
+
+nxBool nxUpdate(Next N, NxFrameRoutine f)
+{
+    if (N->headless)
+    {
+        // No clock to wait for, so every call is a frame
+        nxFrameRun(N, f);
+        if (N->renderMode == NX_RENDER_MODE_SCANLINE || N->redrawPending) nxFrameShow(N);
+        return NX_YES;
+    }
+
+    if (N->turbo)
+    {
+        nxFrameStep(N, f);
+        return nxWindowPump();
+    }
+
+    nxFloat t = nxTime(N);
+    N->currentTime += t;
+
+    // Run every frame that is due, so the frame routine stays locked to 50Hz, but only up to a limit so that a long
+    // stall doesn't make the next call run for ages.
+    int due = (int)(N->currentTime / FRAME_TIME);
+    if (due > N->maxCatchUp)
+    {
+        int dropped = due - N->maxCatchUp;
+        N->stats.droppedFrames += dropped;
+        N->currentTime -= dropped * FRAME_TIME;
+        due = N->maxCatchUp;
+    }
+
+    for (int i = 0; i < due; ++i)
+    {
+        N->currentTime -= FRAME_TIME;
+        if (i > 0) ++N->stats.caughtUpFrames;
+
+        if (N->renderMode == NX_RENDER_MODE_SCANLINE)
+        {
+            // Finish the last frame and show it, unless it was only run to catch up
+            if (i == 0 || !N->catchUpSkipRender)
+            {
+                nxRenderLinesTo(N, NX_WINDOW_HEIGHT);
+                nxRedraw(N);
+            }
+            N->scanline = 0;
+        }
+        nxFrameRun(N, f);
+        if (N->presenter && (i == due - 1 || !N->catchUpSkipRender))
+        {
+            nxPresenterSubmit(N->presenter);
+        }
+    }
+
+    if (N->renderMode == NX_RENDER_MODE_SCANLINE)
+    {
+        int line = (int)(N->currentTime * FRAME_RATE * NX_FRAME_LINES) - NX_FRAME_FIRST_LINE;
+        nxRenderLinesTo(N, NX_MIN(line, NX_WINDOW_HEIGHT));
+    }
+
+    nxBool open = nxWindowPump();
 
-//----------------------------------------------------------------------------------------------------------------------
-// Win32 implementation of API
-//----------------------------------------------------------------------------------------------------------------------
+    // Wait until the next frame is due, or return early to handle input as soon as it arrives.  The time waited is
+    // picked up by nxTime on the next call.
+    N->stats.lastSleepTime = 0;
+    if (N->framePacing && open)
+    {
+        nxFloat start = nxClock();
+        nxWindowWait(N, N->lastTimeStamp + FRAME_TIME - N->currentTime);
+        N->stats.lastSleepTime = nxClock() - start;
+        N->stats.sleepTime += N->stats.lastSleepTime;
+        open = nxWindowPump();
+    }
 
-#define FRAME_RATE  50
-#define FRAME_TIME  (1.0 / (nxFloat)FRAME_RATE)
+    return open;
+}
 
-NxInternal nxFloat nxTime(Next N)
+void nxRedraw(Next N)
 {
-    clock_t t = clock();
-    clock_t diff = t - N->lastTimeStamp;
-    nxFloat secs = (nxFloat)diff / (nxFloat)CLOCKS_PER_SEC;
-    N->lastTimeStamp = t;
-    return secs;
+    nxWindowRedraw(N);
 }
 
-Next nxOpen()
+// Bring the image up to date with the current state.
+NxInternal void nxRenderPending(Next N)
 {
-    Next N = NX_ALLOC(sizeof(struct _Next));
-
-    nxMemoryClear(N, sizeof(struct _Next));
-    N->image = NX_ALLOC(sizeof(nxDword) * NX_WINDOW_WIDTH * NX_WINDOW_HEIGHT);
-    N->window = nxWin32MakeWindow("ZX Spectrum Next", N, 4);
-    N->flash = NX_NO;
-    N->flashCount = 0;
-    N->lastTimeStamp = clock();
-    N->currentTime = 0;
+    if (N->renderMode == NX_RENDER_MODE_SCANLINE)
+    {
+        nxRenderLinesTo(N, NX_WINDOW_HEIGHT);
+    }
+    else
+    {
+        nxRender(N);
+    }
+}
 
-    N->banks[0] = 0;
-    N->banks[1] = 5;
-    N->banks[2] = 2;
-    N->banks[3] = 0;
-    N->page0_2 = 0;
-    N->page3_5 = 0;
+const nxDword* nxFrameBuffer(Next N)
+{
+    nxRenderPending(N);
+    return N->image;
+}
 
-    for (int i = 0; i < 256; ++i) N->palette[i] = i;
+const nxDword* nxScaledFrameBuffer(Next N, int* width, int* height)
+{
+    nxRenderPending(N);
+    if (width) *width = NX_WINDOW_WIDTH * N->scale;
+    if (height) *height = NX_WINDOW_HEIGHT * N->scale;
+    return nxScaleNext(N);
+}
 
-    N->layer2Bank = 0;
-    N->layer2BankStart = 8;
-    N->layer2ShadowBankStart = 11;
-    N->layer2Transparent = 0xe3;
-    N->layer2ShadowEnable = NX_NO;
-    N->layer2Enable = NX_NO;
-    N->layer2Write0 = NX_NO;
+// Stop the render thread, if there is one.
+NxInternal void nxPresenterStop(Next N)
+{
+    nxPresenterClose(N->presenter);
+    N->presenter = 0;
+}
 
-    N->nextRegSelect = 0;
+// Start the render thread if the context is in NX_RENDER_MODE_THREADED, falling back to NX_RENDER_MODE_FRAME if it
+// cannot start.
+NxInternal void nxPresenterStart(Next N)
+{
+    if (N->renderMode != NX_RENDER_MODE_THREADED) return;
 
-    return N;
+    nxDirtyAll(N);
+    N->presenter = nxPresenterOpen(N);
+    if (!N->presenter) N->renderMode = NX_RENDER_MODE_FRAME;
 }
 
-void nxClose(Next N)
+void nxSetOption(Next N, NxOption option, int value)
 {
-    if (N)
+    switch (option)
     {
-        if (gWindows[N->window].handle != INVALID_HANDLE_VALUE)
+    case NX_OPTION_RENDER_PATH:
+        N->renderPath = nxResolveRenderPath((NxRenderPath)value);
+        break;
+
+    case NX_OPTION_RENDER_MODE:
+        if ((NxRenderMode)value == NX_RENDER_MODE_THREADED && N->headless) value = NX_RENDER_MODE_FRAME;
+        if ((NxRenderMode)value != N->renderMode)
+        {
+            nxPresenterStop(N);
+            N->renderMode = (NxRenderMode)value;
+            N->scanline = 0;
+            nxDirtyAll(N);
+            nxPresenterStart(N);
+            nxRedraw(N);
+        }
+        break;
+
+    case NX_OPTION_RENDER_THREADS:
+        value = NX_MIN(NX_MAX(value, 1), NX_RENDER_NUM_BANDS);
+        if (value != N->renderThreads)
         {
-            nxWin32CloseWindow(N->window);
+            // The render thread uses the pool, so stop it while the pool is replaced
+            nxPresenterStop(N);
+            nxPoolClose(N->renderPool);
+            N->renderPool = value > 1 ? nxPoolOpen(value - 1) : 0;
+            N->renderThreads = value;
+            nxPresenterStart(N);
         }
-        NX_FREE(N->image);
-        NX_FREE(N);
-    }
-}
+        break;
 
-nxBool nxUpdate(Next N, NxFrameRoutine f)
-{
-    nxFloat t = nxTime(N);
-    N->currentTime += t;
-    if (N->currentTime > FRAME_TIME)
-    {
-        N->currentTime -= FRAME_TIME;
-        if (++N->flashCount == 16)
+    case NX_OPTION_SCALE:
+        value = NX_MIN(NX_MAX(value, 1), NX_MAX_SCALE);
+        if (value != N->scale)
         {
-            N->flashCount = 0;
-            N->flash = !N->flash;
+            // The render thread scales to its own buffer, so restart it with the new scale
+            nxPresenterStop(N);
+            N->scale = value;
+            nxWindowScale(N);
+            nxPresenterStart(N);
             nxRedraw(N);
         }
-        if (f)
+        break;
+
+    case NX_OPTION_FRAME_PACING:
+        N->framePacing = NX_AS_BOOL(value);
+        break;
+
+    case NX_OPTION_TURBO:
+        if (NX_AS_BOOL(value) != N->turbo)
         {
-            f(N);
+            N->turbo = NX_AS_BOOL(value);
+            N->renderCount = 0;
+            if (!N->turbo)
+            {
+                // Back to real time, and show any redraws that were held back
+                nxClockReset(N);
+                if (N->redrawPending && !N->headless) nxWindowInvalidate(N);
+            }
         }
+        break;
+
+    case NX_OPTION_RENDER_INTERVAL:
+        N->renderInterval = NX_MAX(value, 0);
+        N->renderCount = 0;
+        break;
+
+    case NX_OPTION_MAX_CATCH_UP:
+        N->maxCatchUp = NX_MAX(value, 1);
+        break;
+
+    case NX_OPTION_CATCH_UP_SKIP_RENDER:
+        N->catchUpSkipRender = NX_AS_BOOL(value);
+        break;
     }
-    return nxWin32Pump();
 }
 
-void nxRedraw(Next N)
+void nxGetStats(Next N, NxStats* stats)
 {
-    nxWin32Redraw(N->window);
+    *stats = N->stats;
+}
+
+int nxGetOption(Next N, NxOption option)
+{
+    switch (option)
+    {
+    case NX_OPTION_RENDER_PATH:     return (int)N->renderPath;
+    case NX_OPTION_RENDER_THREADS:  return N->renderThreads;
+    case NX_OPTION_RENDER_MODE:     return (int)N->renderMode;
+    case NX_OPTION_SCALE:           return N->scale;
+    case NX_OPTION_FRAME_PACING:    return (int)N->framePacing;
+    case NX_OPTION_TURBO:           return (int)N->turbo;
+    case NX_OPTION_RENDER_INTERVAL: return N->renderInterval;
+    case NX_OPTION_MAX_CATCH_UP:    return N->maxCatchUp;
+    case NX_OPTION_CATCH_UP_SKIP_RENDER: return (int)N->catchUpSkipRender;
+    }
+
+    return 0;
 }
 
+#ifdef _WIN32
+
 NxInternal BOOL WINAPI nxWin32HandleConsoleClose(DWORD ctrlType)
 {
     return TRUE;
@@ -1100,38 +4401,41 @@ void nxConsoleOpen()
     printf("\033[31;1mWarning: \033[0mClosing this window will terminate the application immediately.\n\n");
 }
 
+#else
+
+void nxConsoleOpen()
+{
+    // stdout is already the terminal
+}
+
+#endif // _WIN32
+
+#if NX_WINDOW_WIN32
+
 int WINAPI WinMain(HINSTANCE inst, HINSTANCE prev, LPSTR cmdLine, int cmdShow)
 {
     return nxMain(__argc, __argv);
 }
 
-//----------------------------------------------------------------------------------------------------------------------
-// Win32 version of memory API
-//----------------------------------------------------------------------------------------------------------------------
+#else
 
-NxInternal nxCalcMem(Next N, nxWord address, nxByte* bank, nxWord* p, nxBool isWrite)
+int main(int argc, char** argv)
 {
-    nxWord slot = (address & 0xc000) >> 14;
-    *p = (address & 0x3fff);
-
-    if (slot == 0 && isWrite && N->layer2Write0)
-    {
-        // Slot 1 writes access current VRAM
-        *bank = N->layer2ShadowEnable ? N->layer2ShadowBankStart + N->layer2Bank
-                                      : N->layer2BankStart + N->layer2Bank;
-    }
-    else
-    {
-        *bank = N->banks[slot];
-    }
+    return nxMain(argc, argv);
 }
 
+#endif
+
+//----------------------------------------------------------------------------------------------------------------------
+// Memory API
+//----------------------------------------------------------------------------------------------------------------------
+
 void nxPoke(Next N, nxWord address, nxByte b)
 {
-    nxByte bank;
-    nxWord p;
-    nxCalcMem(N, address, &bank, &p, NX_YES);
-    N->pages[bank][p] = b;
+    int slot = address >> 13;
+    nxWord p = address & 0x1fff;
+    nxSlotWrite(N, slot)[p] = b;
+    nxDirtyWrite(N, N->writeBank[slot], N->writeBase[slot] + p);
 }
 
 void nxPoke16(Next N, nxWord address, nxWord w)
@@ -1142,8 +4446,12 @@ void nxPoke16(Next N, nxWord address, nxWord w)
 
 void nxPokeEx(Next N, nxByte bank, nxWord address, nxByte b)
 {
+    nxByte* mem = nxBankWrite(N, bank);
+    if (!mem) return;
+
     address &= 0x3fff;
-    N->pages[bank][address] = b;
+    mem[address] = b;
+    nxDirtyWrite(N, bank, address);
 }
 
 void nxPoke16Ex(Next N, nxByte bank, nxWord address, nxWord w)
@@ -1152,38 +4460,228 @@ void nxPoke16Ex(Next N, nxByte bank, nxWord address, nxWord w)
     nxPokeEx(N, bank, address + 1, NX_HI(w));
 }
 
-nxBool nxPokeBuffer(Next N, nxWord address, const void* buffer, nxWord size)
+// Call op on each part of size bytes from address that lies within one 8K slot, and so is contiguous in memory.  That
+// is at most eight parts.  mem points to the part, which is at p in bank, or bank is 0xff if the slot is unmapped.
+typedef void(*NxSlotOp)(Next N, nxByte* mem, nxByte bank, nxWord p, nxWord offset, nxWord count, void* data);
+
+NxInternal void nxForSlots(Next N, nxWord address, nxWord size, nxBool isWrite, NxSlotOp op, void* data)
 {
-    if ((nxInt)address + (nxInt)size > 65536) return NX_NO;
-    nxByte* b = (nxByte *)buffer;
-    for (nxWord i = 0; i < size; ++i)
+    nxInt offset = 0;
+    while (offset < size)
     {
-        nxPoke(N, address + i, *b++);
+        nxWord a = (nxWord)(address + offset);
+        int slot = a >> 13;
+        nxWord p = a & 0x1fff;
+        nxWord count = (nxWord)NX_MIN((nxInt)size - offset, 0x2000 - (nxInt)p);
+
+        if (isWrite)
+        {
+            op(N, nxSlotWrite(N, slot) + p, N->writeBank[slot], N->writeBase[slot] + p, (nxWord)offset, count, data);
+        }
+        else
+        {
+            op(N, N->readMap[slot] + p, N->readBank[slot], N->readBase[slot] + p, (nxWord)offset, count, data);
+        }
+        offset += count;
     }
-    nxRedraw(N);
+}
+
+typedef struct
+{
+    nxByte*             buffer;
+    nxByte              fill;
+    nxBool              visible;
+}
+NxBulkOp;
+
+NxInternal void nxPokeSlot(Next N, nxByte* mem, nxByte bank, nxWord p, nxWord offset, nxWord count, void* data)
+{
+    NxBulkOp* op = (NxBulkOp *)data;
+    nxMemoryCopy(op->buffer + offset, mem, count);
+    op->visible |= nxDirtyRange(N, bank, p, count);
+}
+
+NxInternal void nxPeekSlot(Next N, nxByte* mem, nxByte bank, nxWord p, nxWord offset, nxWord count, void* data)
+{
+    NxBulkOp* op = (NxBulkOp *)data;
+    nxMemoryCopy(mem, op->buffer + offset, count);
+}
+
+NxInternal void nxFillSlot(Next N, nxByte* mem, nxByte bank, nxWord p, nxWord offset, nxWord count, void* data)
+{
+    NxBulkOp* op = (NxBulkOp *)data;
+    memset(mem, op->fill, count);
+    op->visible |= nxDirtyRange(N, bank, p, count);
+}
+
+nxBool nxPokeBuffer(Next N, nxWord address, const void* buffer, nxWord size)
+{
+    if ((nxInt)address + (nxInt)size > 65536) return NX_NO;
+    NxBulkOp op = { (nxByte *)buffer, 0, NX_NO };
+    nxForSlots(N, address, size, NX_YES, &nxPokeSlot, &op);
+    if (op.visible) nxRedraw(N);
     return NX_YES;
 }
 
 nxBool nxPokeBufferEx(Next N, nxByte bank, nxWord address, const void* buffer, nxWord size)
+{
+    // Check before committing the bank, so that failed or empty writes don't allocate or copy it
+    if ((nxInt)address + (nxInt)size > 16384 || bank >= N->numBanks) return NX_NO;
+    if (!size) return NX_YES;
+    nxByte* mem = nxBankWrite(N, bank);
+    nxMemoryCopy(buffer, mem + address, size);
+    if (nxDirtyRange(N, bank, address, size)) nxRedraw(N);
+    return NX_YES;
+}
+
+nxBool nxPeekBuffer(Next N, nxWord address, void* buffer, nxWord size)
+{
+    if ((nxInt)address + (nxInt)size > 65536) return NX_NO;
+    NxBulkOp op = { (nxByte *)buffer, 0, NX_NO };
+    nxForSlots(N, address, size, NX_NO, &nxPeekSlot, &op);
+    return NX_YES;
+}
+
+nxBool nxPeekBufferEx(Next N, nxByte bank, nxWord address, void* buffer, nxWord size)
 {
     if ((nxInt)address + (nxInt)size > 16384) return NX_NO;
-    nxByte* b = (nxByte *)buffer;
-    for (nxWord i = 0; i < size; ++i)
+    nxMemoryCopy(nxBankRead(N, bank) + address, buffer, size);
+    return NX_YES;
+}
+
+nxBool nxFill(Next N, nxWord address, nxByte b, nxWord size)
+{
+    if ((nxInt)address + (nxInt)size > 65536) return NX_NO;
+    NxBulkOp op = { 0, b, NX_NO };
+    nxForSlots(N, address, size, NX_YES, &nxFillSlot, &op);
+    if (op.visible) nxRedraw(N);
+    return NX_YES;
+}
+
+nxBool nxFillEx(Next N, nxByte bank, nxWord address, nxByte b, nxWord size)
+{
+    if ((nxInt)address + (nxInt)size > 16384 || bank >= N->numBanks) return NX_NO;
+    if (!size) return NX_YES;
+    nxByte* mem = nxBankWrite(N, bank);
+    memset(mem + address, b, size);
+    if (nxDirtyRange(N, bank, address, size)) nxRedraw(N);
+    return NX_YES;
+}
+
+typedef struct
+{
+    nxByte*             mem;
+    nxByte              bank;
+    nxWord              p;
+    nxWord              offset;
+    nxWord              count;
+}
+NxSlotPart;
+
+typedef struct
+{
+    NxSlotPart          parts[8];
+    int                 count;
+}
+NxSlotParts;
+
+NxInternal void nxPartSlot(Next N, nxByte* mem, nxByte bank, nxWord p, nxWord offset, nxWord count, void* data)
+{
+    NxSlotParts* parts = (NxSlotParts *)data;
+    NxSlotPart part = { mem, bank, p, offset, count };
+    parts->parts[parts->count++] = part;
+}
+
+nxBool nxMemCopy(Next N, nxWord dst, nxWord src, nxWord size)
+{
+    if ((nxInt)dst + (nxInt)size > 65536 || (nxInt)src + (nxInt)size > 65536) return NX_NO;
+
+    NxSlotParts from = { 0 };
+    NxSlotParts to = { 0 };
+    nxForSlots(N, src, size, NX_NO, &nxPartSlot, &from);
+    nxForSlots(N, dst, size, NX_YES, &nxPartSlot, &to);
+
+    // The areas can share memory even if their addresses don't overlap, since a page can be mapped into more than
+    // one slot, and Layer 2 can map writes to different memory from reads.
+    nxBool overlap = NX_NO;
+    for (int i = 0; i < from.count; ++i)
     {
-        nxPokeEx(N, bank, address++, *b++);
+        for (int j = 0; j < to.count; ++j)
+        {
+            const NxSlotPart* f = &from.parts[i];
+            const NxSlotPart* t = &to.parts[j];
+            if (f->mem < t->mem + t->count && t->mem < f->mem + f->count) overlap = NX_YES;
+        }
     }
-    nxRedraw(N);
+
+    if (overlap)
+    {
+        // Copy through a buffer so every byte is read before any is written
+        nxByte* buffer = (nxByte *)NX_ALLOC(NX_MAX(size, 1));
+        nxPeekBuffer(N, src, buffer, size);
+        nxPokeBuffer(N, dst, buffer, size);
+        NX_FREE(buffer);
+        return NX_YES;
+    }
+
+    // Copy each piece that is contiguous in both a source and a destination bank
+    nxBool visible = NX_NO;
+    for (int i = 0; i < from.count; ++i)
+    {
+        for (int j = 0; j < to.count; ++j)
+        {
+            const NxSlotPart* f = &from.parts[i];
+            const NxSlotPart* t = &to.parts[j];
+            nxInt start = NX_MAX(f->offset, t->offset);
+            nxInt end = NX_MIN(f->offset + f->count, t->offset + t->count);
+            if (start >= end) continue;
+
+            nxWord dp = (nxWord)(t->p + (start - t->offset));
+            nxMemoryCopy(f->mem + (start - f->offset), t->mem + (start - t->offset), end - start);
+            visible |= nxDirtyRange(N, t->bank, dp, end - start);
+        }
+    }
+
+    if (visible) nxRedraw(N);
     return NX_YES;
 }
 
+nxQword nxDirtyQuery(Next N, nxByte bank)
+{
+    return bank < N->numBanks ? N->writtenBlocks[bank] : 0;
+}
+
+void nxDirtyClear(Next N, nxByte bank)
+{
+    if (bank == NX_ALL_BANKS)
+    {
+        nxMemoryClear(N->writtenBlocks, sizeof(N->writtenBlocks));
+    }
+    else
+    {
+        N->writtenBlocks[bank] = 0;
+    }
+}
+
+// Write loaded data to the address.  Returns NX_NO, having written nothing, if it runs past 64K.
+NxInternal nxBool nxPokeData(Next N, nxWord address, const NxData* d)
+{
+    if (!d->bytes || d->size > 65536 - (nxInt)address) return NX_NO;
+
+    // All 64K is too big for an nxWord size, so write it in two halves
+    nxWord half = (nxWord)(d->size / 2);
+    return nxPokeBuffer(N, address, d->bytes, half) &&
+           nxPokeBuffer(N, (nxWord)(address + half), d->bytes + half, (nxWord)(d->size - half));
+}
+
 nxBool nxPokeFile(Next N, nxWord address, const char* fileName)
 {
     nxBool result = NX_NO;
     NxData d = nxDataLoad(fileName);
     if (d.bytes)
     {
-        result = nxPokeBuffer(N, address, d.bytes, (nxWord)d.size);
-        nxDataUnload(d);
+        result = nxPokeData(N, address, &d);
+        nxDataUnload(&d);
     }
 
     return result;
@@ -1191,32 +4689,202 @@ nxBool nxPokeFile(Next N, nxWord address, const char* fileName)
 
 nxByte nxPeek(Next N, nxWord address)
 {
-    nxByte bank;
-    nxWord p;
-    nxCalcMem(N, address, &bank, &p, NX_NO);
-    return nxPeekEx(N, bank, p);
+    return N->readMap[address >> 13][address & 0x1fff];
+}
+
+nxWord nxPeek16(Next N, nxWord address)
+{
+    return nxPeek(N, address) + 256 * nxPeek(N, address + 1);
+}
+
+nxByte nxPeekEx(Next N, nxByte bank, nxWord p)
+{
+    p &= 0x3fff;
+    return nxBankRead(N, bank)[p];
+}
+
+nxWord nxPeek16Ex(Next N, nxByte bank, nxWord p)
+{
+    return nxPeekEx(N, bank, p) + 256 * nxPeekEx(N, bank, p + 1);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Snapshot API
+//
+// Taking a snapshot adds a reference to every bank and rebuilds the write mapping, which leaves the slots of shared
+// banks writing through 0 so the next write to each one copies it (see nxBankWrite).  Restoring only swaps the banks
+// that differ from the snapshot's.
+//----------------------------------------------------------------------------------------------------------------------
+
+struct _NxSnapshot
+{
+    NxBank*             banks[NX_MAX_BANKS];        // 0 for banks that had not been written
+    int                 numBanks;
+
+    // Paging
+    nxByte              mmu[8];
+    nxByte              page0_2;
+    nxByte              page3_5;
+
+    // Layer 2
+    nxByte              layer2Bank;
+    nxByte              layer2BankStart;
+    nxByte              layer2ShadowBankStart;
+    nxByte              layer2Transparent;
+    nxBool              layer2ShadowEnable;
+    nxBool              layer2Enable;
+    nxBool              layer2Write0;
+
+    // Palettes
+    nxWord              colours[NX_NUM_PALETTES][256];
+    nxByte              paletteIndex;
+    nxByte              paletteControl;
+    nxBool              paletteSecondWrite;
+    nxByte              paletteFirstByte;
+
+    // ULA and registers
+    nxByte              border;
+    int                 flashCount;
+    nxBool              flash;
+    nxByte              nextRegSelect;
+};
+
+NxSnapshot nxSnapshot(Next N)
+{
+    NxSnapshot S = (NxSnapshot)NX_ALLOC(sizeof(struct _NxSnapshot));
+    nxMemoryClear(S, sizeof(struct _NxSnapshot));
+
+    S->numBanks = N->numBanks;
+    for (int i = 0; i < N->numBanks; ++i)
+    {
+        S->banks[i] = N->banks[i];
+        if (S->banks[i]) nxAtomicInc(&S->banks[i]->refs);
+    }
+
+    nxMemoryCopy(N->mmu, S->mmu, sizeof(S->mmu));
+    S->page0_2 = N->page0_2;
+    S->page3_5 = N->page3_5;
+
+    S->layer2Bank = N->layer2Bank;
+    S->layer2BankStart = N->layer2BankStart;
+    S->layer2ShadowBankStart = N->layer2ShadowBankStart;
+    S->layer2Transparent = N->layer2Transparent;
+    S->layer2ShadowEnable = N->layer2ShadowEnable;
+    S->layer2Enable = N->layer2Enable;
+    S->layer2Write0 = N->layer2Write0;
+
+    for (int p = 0; p < NX_NUM_PALETTES; ++p)
+    {
+        nxMemoryCopy(N->palettes[p].colours, S->colours[p], sizeof(S->colours[p]));
+    }
+    S->paletteIndex = N->paletteIndex;
+    S->paletteControl = N->paletteControl;
+    S->paletteSecondWrite = N->paletteSecondWrite;
+    S->paletteFirstByte = N->paletteFirstByte;
+
+    S->border = N->border;
+    S->flashCount = N->flashCount;
+    S->flash = N->flash;
+    S->nextRegSelect = N->nextRegSelect;
+
+    // The context's banks are shared now, so writes must go through nxBankWrite
+    nxMmuUpdate(N);
+
+    return S;
 }
 
-nxWord nxPeek16(Next N, nxWord address)
-{
-    return nxPeek(N, address) + 256 * nxPeek(N, address + 1);
+nxBool nxRestore(Next N, NxSnapshot S)
+{
+    if (S->numBanks != N->numBanks) return NX_NO;
+
+    for (int i = 0; i < N->numBanks; ++i)
+    {
+        if (N->banks[i] != S->banks[i])
+        {
+            if (S->banks[i]) nxAtomicInc(&S->banks[i]->refs);
+            nxBankRelease(N->banks[i]);
+            N->banks[i] = S->banks[i];
+            N->writtenBlocks[i] = ~(nxQword)0;
+        }
+    }
+
+    nxMemoryCopy(S->mmu, N->mmu, sizeof(N->mmu));
+    N->page0_2 = S->page0_2;
+    N->page3_5 = S->page3_5;
+
+    N->layer2Bank = S->layer2Bank;
+    N->layer2BankStart = S->layer2BankStart;
+    N->layer2ShadowBankStart = S->layer2ShadowBankStart;
+    N->layer2Transparent = S->layer2Transparent;
+    N->layer2ShadowEnable = S->layer2ShadowEnable;
+    N->layer2Enable = S->layer2Enable;
+    N->layer2Write0 = S->layer2Write0;
+
+    // Only palettes that have changed get a new version, so the others keep their caches
+    for (int p = 0; p < NX_NUM_PALETTES; ++p)
+    {
+        NxPalette* P = &N->palettes[p];
+        if (memcmp(P->colours, S->colours[p], sizeof(P->colours)))
+        {
+            nxMemoryCopy(S->colours[p], P->colours, sizeof(P->colours));
+            ++P->version;
+        }
+    }
+    N->paletteIndex = S->paletteIndex;
+    N->paletteControl = S->paletteControl;
+    N->paletteSecondWrite = S->paletteSecondWrite;
+    N->paletteFirstByte = S->paletteFirstByte;
+
+    N->border = S->border;
+    N->flashCount = S->flashCount;
+    N->flash = S->flash;
+    N->nextRegSelect = S->nextRegSelect;
+
+    nxMmuUpdate(N);
+    nxFlashRebuild(N);
+    nxDirtyAll(N);
+    nxRedraw(N);
+
+    return NX_YES;
 }
 
-nxByte nxPeekEx(Next N, nxByte bank, nxWord p)
+void nxSnapshotFree(NxSnapshot S)
 {
-    p &= 0x3fff;
-    return N->pages[bank][p];
-}
+    if (!S) return;
 
-nxWord nxPeek16Ex(Next N, nxByte bank, nxWord p)
-{
-    return nxPeekEx(N, bank, p) + 256 * nxPeekEx(N, bank, p + 1);
+    for (int i = 0; i < S->numBanks; ++i) nxBankRelease(S->banks[i]);
+    NX_FREE(S);
 }
 
 //----------------------------------------------------------------------------------------------------------------------
 // IO port API
 //----------------------------------------------------------------------------------------------------------------------
 
+// Write a colour to the palette selected by register 0x43, at the index in register 0x40.
+NxInternal void nxWritePalette(Next N, nxWord colour)
+{
+    int p = (N->paletteControl & 0x70) >> 4;
+    nxPaletteSet(&N->palettes[p], N->paletteIndex, colour);
+
+    N->paletteSecondWrite = NX_NO;
+    if (!(N->paletteControl & 0x80))
+    {
+        ++N->paletteIndex;
+    }
+
+    NxPalette* P = &N->palettes[p];
+    if (P == nxActivePalette(N, NX_PALETTE_ULA))
+    {
+        nxDirtyAll(N);
+        nxRedraw(N);
+    }
+    else if (N->layer2Enable && P == nxActivePalette(N, NX_PALETTE_LAYER2))
+    {
+        nxDirtyScreen(N);
+        nxRedraw(N);
+    }
+}
+
 void nxOut(Next N, nxWord port, nxByte b)
 {
     nxByte h = NX_HI(port);
@@ -1237,16 +4905,20 @@ void nxOut(Next N, nxWord port, nxByte b)
                 break;
             }
 
-            // Switch slot 4
-            N->banks[3] = N->page0_2 + (N->page3_5 << 3);
+            // Switch the top 16K
+            nxMmuSetBank(N, N->page0_2 + (N->page3_5 << 3));
         }
         break;
 
     case 0xfe:
         {
             nxByte border = b & 7;
-            N->border = border;
-            nxRedraw(N);
+            if (border != N->border)
+            {
+                N->border = border;
+                N->dirtyBorder = NX_YES;
+                nxRedraw(N);
+            }
         }
         break;
 
@@ -1256,11 +4928,19 @@ void nxOut(Next N, nxWord port, nxByte b)
         {
         case 0x12:  // Layer 2 access port
             {
+                nxBool shadow = NX_AS_BOOL(b & 0x08);
+                nxBool enable = NX_AS_BOOL(b & 0x02);
+                if (shadow != N->layer2ShadowEnable || enable != N->layer2Enable)
+                {
+                    nxDirtyScreen(N);
+                    nxRedraw(N);
+                }
+
                 N->layer2Bank = (b & 0xc0) >> 6;
-                N->layer2ShadowEnable = NX_AS_BOOL(b & 0x08);
-                N->layer2Enable = NX_AS_BOOL(b & 0x02);
+                N->layer2ShadowEnable = shadow;
+                N->layer2Enable = enable;
                 N->layer2Write0 = NX_AS_BOOL(b & 0x01);
-                nxRedraw(N);
+                nxMmuUpdate(N);
             }
             break;
 
@@ -1273,16 +4953,62 @@ void nxOut(Next N, nxWord port, nxByte b)
             {
             case 0x12:  // Layer 2 bank start
                 N->layer2BankStart = (b & 31);
+                if (N->layer2Write0) nxMmuUpdate(N);
+                nxDirtyScreen(N);
                 nxRedraw(N);
                 break;
 
             case 0x13:  // Layer 2 shadow bank start
                 N->layer2ShadowBankStart = (b & 31);
+                if (N->layer2Write0) nxMmuUpdate(N);
+                nxDirtyScreen(N);
                 nxRedraw(N);
                 break;
 
             case 0x14:  // Layer 2 transparency register
                 N->layer2Transparent = b;
+                nxDirtyScreen(N);
+                nxRedraw(N);
+                break;
+
+            case 0x40:  // Palette index
+                N->paletteIndex = b;
+                N->paletteSecondWrite = NX_NO;
+                break;
+
+            case 0x41:  // Palette value (8-bit colour)
+                nxWritePalette(N, nxColourFrom8Bit(b));
+                break;
+
+            case 0x43:  // Palette control
+                if ((b ^ N->paletteControl) & 0x0e)
+                {
+                    // Active palettes have changed
+                    nxDirtyAll(N);
+                    nxRedraw(N);
+                }
+                N->paletteControl = b;
+                N->paletteSecondWrite = NX_NO;
+                break;
+
+            case 0x44:  // Palette value (9-bit colour), 2 writes: RRRGGGBB then P000000B
+                if (N->paletteSecondWrite)
+                {
+                    nxWord colour = (nxWord)(N->paletteFirstByte << 1) | (b & 1);
+                    if (b & 0x80) colour |= NX_PALETTE_PRIORITY;
+                    nxWritePalette(N, colour);
+                }
+                else
+                {
+                    N->paletteFirstByte = b;
+                    N->paletteSecondWrite = NX_YES;
+                }
+                break;
+
+            case 0x50: case 0x51: case 0x52: case 0x53:     // MMU slots
+            case 0x54: case 0x55: case 0x56: case 0x57:
+                N->mmu[N->nextRegSelect - 0x50] = b;
+                nxMmuUpdate(N);
                 break;
             }
             break;
@@ -1295,6 +5021,26 @@ void nxOut(Next N, nxWord port, nxByte b)
 
 nxByte nxIn(Next N, nxWord port)
 {
+    if (port == NX_PORT_REG_RW)
+    {
+        const NxPalette* P = &N->palettes[(N->paletteControl & 0x70) >> 4];
+
+        switch (N->nextRegSelect)
+        {
+        case 0x12:  return N->layer2BankStart;
+        case 0x13:  return N->layer2ShadowBankStart;
+        case 0x14:  return N->layer2Transparent;
+        case 0x40:  return N->paletteIndex;
+        case 0x41:  return (nxByte)(P->colours[N->paletteIndex] >> 1);
+        case 0x43:  return N->paletteControl;
+        case 0x44:  return (nxByte)((P->colours[N->paletteIndex] & 1) |
+                                    ((P->colours[N->paletteIndex] & NX_PALETTE_PRIORITY) ? 0x80 : 0));
+        case 0x50: case 0x51: case 0x52: case 0x53:
+        case 0x54: case 0x55: case 0x56: case 0x57:
+                    return N->mmu[N->nextRegSelect - 0x50];
+        }
+    }
+
     return 0;
 }
 
@@ -1314,7 +5060,7 @@ void nxBank(Next N, nxByte bank)
 {
     N->page0_2 = bank & 0x07;
     N->page3_5 = (bank >> 3);
-    N->banks[3] = bank;
+    nxMmuSetBank(N, bank);
 }
 
 //----------------------------------------------------------------------------------------------------------------------
@@ -1333,12 +5079,13 @@ NxInternal nxByte nxSnapPalette(Next N, nxByte r, nxByte g, nxByte b)
     nxFloat rr = (nxFloat)r;
     nxFloat gg = (nxFloat)g;
     nxFloat bb = (nxFloat)b;
+    const NxPalette* P = nxPaletteCache(nxActivePalette(N, NX_PALETTE_LAYER2));
 
     for (int i = 0; i < 256; ++i)
     {
-        nxFloat prr = (nxFloat)(kColour_3bit[(N->palette[i] & 0xe0) >> 5]);
-        nxFloat pgg = (nxFloat)(kColour_3bit[(N->palette[i] & 0x1c) >> 2]);
-        nxFloat pbb = (nxFloat)(kColour_2bit[(N->palette[i] & 0x03) >> 0]);
+        nxFloat prr = (nxFloat)P->rgb[i][0];
+        nxFloat pgg = (nxFloat)P->rgb[i][1];
+        nxFloat pbb = (nxFloat)P->rgb[i][2];
 
         nxFloat rrr = (rr - prr);
         nxFloat ggg = (gg - pgg);
@@ -1354,13 +5101,10 @@ NxInternal nxByte nxSnapPalette(Next N, nxByte r, nxByte g, nxByte b)
     return nearestIndex;
 }
 
-nxByte* nxPngRead(Next N, const char* filename, nxWord* width, nxWord* height)
+// Convert an RGBA image loaded by STB to the CURRENT palette.
+NxInternal nxByte* nxPngConvert(Next N, const nxDword* in, int w, int h)
 {
-    int w, h, bpp;
-    nxDword* img = (nxDword *)stbi_load(filename, &w, &h, &bpp, 4);
-    nxDword* in = img;
-    if (!img) return 0;
-    nxQword size = w * h;
+    nxQword size = (nxQword)w * h;
 
     nxByte* nxtImg = NX_ALLOC(size);
     nxByte* out = nxtImg;
@@ -1381,6 +5125,17 @@ nxByte* nxPngRead(Next N, const char* filename, nxWord* width, nxWord* height)
         }
     }
 
+    return nxtImg;
+}
+
+nxByte* nxPngRead(Next N, const char* filename, nxWord* width, nxWord* height)
+{
+    int w, h, bpp;
+    nxDword* img = (nxDword *)stbi_load(filename, &w, &h, &bpp, 4);
+    if (!img) return 0;
+
+    nxByte* nxtImg = nxPngConvert(N, img, w, h);
+
     stbi_image_free(img);
     *width = w;
     *height = h;
@@ -1411,13 +5166,12 @@ NxInternal nxDword nxAdler32(nxDword state, const nxByte* data, nxInt len)
 }
 
 // Table of CRCs of all 8-bit messages.
-unsigned long kCrcTable[256];
+static nxDword kCrcTable[256];
 
-// Flag: has the table been computed? Initially false.
-nxBool gCrcTableComputed = NX_NO;
+static NxOnce gCrcTableOnce = NX_ONCE_INIT;
 
 // Make the table for a fast CRC.
-void nxCrcMakeTable(void)
+NxInternal void nxCrcMakeTable(void)
 {
     nxDword c;
     int n, k;
@@ -1432,7 +5186,6 @@ void nxCrcMakeTable(void)
         }
         kCrcTable[n] = c;
     }
-    gCrcTableComputed = NX_YES;
 }
 
 // Update a running CRC with the bytes data[0..len-1]--the CRC
@@ -1445,7 +5198,7 @@ nxDword nxCrc32Update(nxDword crc, void* data, nxInt len)
     nxDword c = crc;
     nxByte* d = (nxByte *)data;
 
-    if (!gCrcTableComputed) nxCrcMakeTable();
+    nxOnce(&gCrcTableOnce, &nxCrcMakeTable);
     for (nxInt n = 0; n < len; n++) {
         c = kCrcTable[(c ^ d[n]) & 0xff] ^ (c >> 8);
     }
@@ -1464,18 +5217,17 @@ nxBool nxPngWrite(Next N, const char* fileName, nxByte* img, int width, int heig
     nxDword* newImg = NX_ALLOC(sizeof(nxDword)*width*height);
     nxByte* src = (nxByte *)img;
     nxByte* dst = (nxByte *)newImg;
+    const NxPalette* P = nxPaletteCache(nxActivePalette(N, NX_PALETTE_LAYER2));
 
     // Data is BGRABGRA...  should be RGBARGBA...
     for (int yy = 0; yy < height; ++yy)
     {
         for (int xx = 0; xx < width; ++xx)
         {
-            // Write red
-            dst[0] = kColour_3bit[(*src & 0xe0) >> 5];
-            // Write green
-            dst[1] = kColour_3bit[(*src & 0x1c) >> 2];
-            // Write blue
-            dst[2] = kColour_2bit[(*src & 0x03)];
+            // Write red, green and blue
+            dst[0] = P->rgb[*src][0];
+            dst[1] = P->rgb[*src][1];
+            dst[2] = P->rgb[*src][2];
             // Write alpha
             dst[3] = *src == N->layer2Transparent ? 0x00 : 0xff;
             ++src;
@@ -1638,7 +5390,7 @@ nxBool nxPngWrite(Next N, const char* fileName, nxByte* img, int width, int heig
     if (d.bytes)
     {
         nxMemoryCopy(start, d.bytes, numBytes);
-        nxDataUnload(d);
+        nxDataUnload(&d);
         nxArenaDone(&m);
         return NX_YES;
     }
@@ -1654,22 +5406,18 @@ nxByte* nxNimRead(const char* fileName, nxWord* width, nxWord* height)
     if (d.bytes)
     {
         nxWord* header = (nxWord *)d.bytes;
-        if (header[0] != 0) return 0;
+        nxInt size = d.size >= 6 ? (nxInt)header[1] * (nxInt)header[2] : 0;
+        nxByte* img = 0;
 
-        *width = header[1];
-        *height = header[2];
-        nxInt size = (nxInt)header[1] * (nxInt)header[2];
-        nxByte* img = NX_ALLOC(size);
-        if (img)
-        {
-            nxMemoryCopy(&d.bytes[6], img, size);
-        }
-        else
+        if (d.size >= 6 + size && header[0] == 0)
         {
-            return 0;
+            *width = header[1];
+            *height = header[2];
+            img = NX_ALLOC(size);
+            if (img) nxMemoryCopy(&d.bytes[6], img, size);
         }
 
-        nxDataUnload(d);
+        nxDataUnload(&d);
         return img;
     }
 
@@ -1695,13 +5443,460 @@ nxBool nxNimWrite(const char* fileName, nxByte* img, nxWord width, nxWord height
         header[2] = height;
         nxMemoryCopy(img, &header[3], imgSize);
 
-        nxDataUnload(d);
+        nxDataUnload(&d);
         return NX_YES;
     }
 
     return NX_NO;
 }
 
+//----------------------------------------------------------------------------------------------------------------------
+// Asynchronous loading
+//
+// Each context has one loader thread, started by its first async load.  The async calls push loads on the loader's
+// queue, the thread reads them one at a time in order and marks them read, and nxFrameRun commits the read ones on
+// the context's thread at the start of the next frame.  Reading files is bound by the disk rather than the CPU, so
+// one thread is enough to keep the frame routine from blocking on them.
+//----------------------------------------------------------------------------------------------------------------------
+
+typedef enum
+{
+    NX_LOAD_KIND_POKE,
+    NX_LOAD_KIND_NIM,
+    NX_LOAD_KIND_PNG,
+}
+NxLoadKind;
+
+struct _NxLoad
+{
+    Next                N;
+    NxLoad              next;                       // Next in the context's loads
+    NxLoad              nextQueued;                 // Next in the loader's queue
+    NxLoadKind          kind;
+    char*               fileName;
+    nxWord              address;                    // nxPokeFileAsync only
+    nxBool              read;                       // Set by the loader thread when the file has been read
+    NxLoadState         state;                      // Changed only on the context's thread
+    nxBool              freed;                      // nxLoadFree has been called, so destroy it once committed
+
+    // Data read by the loader thread
+    NxData              data;                       // Poke: the mapped file
+    nxDword*            rgba;                       // PNG: the decoded image, before palette conversion
+    nxByte*             image;                      // NIM, and PNG once committed
+    nxWord              width;
+    nxWord              height;
+};
+
+typedef struct _NxLoader
+{
+    NxThread            thread;
+    NxMutex             lock;
+    NxCond              wake;                       // Signalled when a load is queued or the loader closes
+    NxCond              read;                       // Signalled when a load has been read
+    NxLoad              queue;                      // Loads to read, oldest first
+    NxLoad              queueTail;
+    nxBool              quit;
+}
+NxLoader;
+
+// Read a load's file.  Runs on the loader thread, without the lock, so only touches the load's data.
+NxInternal void nxLoadRead(NxLoad L)
+{
+    switch (L->kind)
+    {
+    case NX_LOAD_KIND_POKE:
+        L->data = nxDataLoad(L->fileName);
+        break;
+
+    case NX_LOAD_KIND_NIM:
+        L->image = nxNimRead(L->fileName, &L->width, &L->height);
+        break;
+
+    case NX_LOAD_KIND_PNG:
+#ifdef NX_USE_STB
+        {
+            int w, h, bpp;
+            L->rgba = (nxDword *)stbi_load(L->fileName, &w, &h, &bpp, 4);
+            L->width = (nxWord)w;
+            L->height = (nxWord)h;
+        }
+#endif
+        break;
+    }
+}
+
+NxInternal void nxLoaderThread(void* data)
+{
+    NxLoader* R = (NxLoader *)data;
+
+    nxMutexLock(&R->lock);
+    for (;;)
+    {
+        while (!R->quit && !R->queue) nxCondWait(&R->wake, &R->lock);
+        if (R->quit) break;
+
+        NxLoad L = R->queue;
+        R->queue = L->nextQueued;
+        if (!R->queue) R->queueTail = 0;
+        nxMutexUnlock(&R->lock);
+
+        nxLoadRead(L);
+
+        nxMutexLock(&R->lock);
+        L->read = NX_YES;
+        nxCondBroadcast(&R->read);
+    }
+    nxMutexUnlock(&R->lock);
+}
+
+NxInternal void nxLoadDestroy(NxLoad L)
+{
+    nxDataUnload(&L->data);
+#ifdef NX_USE_STB
+    if (L->rgba) stbi_image_free(L->rgba);
+#endif
+    NX_FREE(L->image);
+    NX_FREE(L->fileName);
+    NX_FREE(L);
+}
+
+// Remove a load from the context's loads and destroy it.
+NxInternal void nxLoadRemove(NxLoad L)
+{
+    NxLoad* link = &L->N->loads;
+    while (*link != L) link = &(*link)->next;
+    *link = L->next;
+    nxLoadDestroy(L);
+}
+
+// Commit a load that has been read, on the context's thread.
+NxInternal void nxLoadCommit(NxLoad L)
+{
+    Next N = L->N;
+
+    switch (L->kind)
+    {
+    case NX_LOAD_KIND_POKE:
+        L->state = nxPokeData(N, L->address, &L->data) ? NX_LOAD_DONE : NX_LOAD_FAILED;
+        nxDataUnload(&L->data);
+        break;
+
+    case NX_LOAD_KIND_NIM:
+        L->state = L->image ? NX_LOAD_DONE : NX_LOAD_FAILED;
+        break;
+
+    case NX_LOAD_KIND_PNG:
+#ifdef NX_USE_STB
+        if (L->rgba)
+        {
+            L->image = nxPngConvert(N, L->rgba, L->width, L->height);
+            stbi_image_free(L->rgba);
+            L->rgba = 0;
+        }
+#endif
+        L->state = L->image ? NX_LOAD_DONE : NX_LOAD_FAILED;
+        break;
+    }
+}
+
+NxInternal nxBool nxLoadIsRead(NxLoad L)
+{
+    NxLoader* R = L->N->loader;
+    if (!R) return L->read;
+
+    nxMutexLock(&R->lock);
+    nxBool read = L->read;
+    nxMutexUnlock(&R->lock);
+    return read;
+}
+
+// Commit every load that has been read since the last frame.
+NxInternal void nxLoadCommitAll(Next N)
+{
+    NxLoad* link = &N->loads;
+    while (*link)
+    {
+        NxLoad L = *link;
+        if (L->state == NX_LOAD_PENDING && nxLoadIsRead(L)) nxLoadCommit(L);
+
+        if (L->freed && L->state != NX_LOAD_PENDING)
+        {
+            *link = L->next;
+            nxLoadDestroy(L);
+        }
+        else
+        {
+            link = &L->next;
+        }
+    }
+}
+
+NxInternal NxLoader* nxLoaderOpen()
+{
+    NxLoader* R = (NxLoader *)NX_ALLOC(sizeof(NxLoader));
+    nxMemoryClear(R, sizeof(NxLoader));
+    nxMutexInit(&R->lock);
+    nxCondInit(&R->wake);
+    nxCondInit(&R->read);
+
+    if (!nxThreadStart(&R->thread, &nxLoaderThread, R))
+    {
+        nxCondDone(&R->read);
+        nxCondDone(&R->wake);
+        nxMutexDone(&R->lock);
+        NX_FREE(R);
+        return 0;
+    }
+
+    return R;
+}
+
+// Stop the loader thread, abandoning any loads it has not started, and destroy every load.
+NxInternal void nxLoaderClose(Next N)
+{
+    NxLoader* R = N->loader;
+    if (R)
+    {
+        nxMutexLock(&R->lock);
+        R->quit = NX_YES;
+        nxCondSignal(&R->wake);
+        nxMutexUnlock(&R->lock);
+        nxThreadJoin(&R->thread);
+
+        nxCondDone(&R->read);
+        nxCondDone(&R->wake);
+        nxMutexDone(&R->lock);
+        NX_FREE(R);
+        N->loader = 0;
+    }
+
+    while (N->loads)
+    {
+        NxLoad L = N->loads;
+        N->loads = L->next;
+        nxLoadDestroy(L);
+    }
+}
+
+NxInternal NxLoad nxLoadStart(Next N, NxLoadKind kind, const char* fileName)
+{
+    NxLoad L = (NxLoad)NX_ALLOC(sizeof(struct _NxLoad));
+    nxMemoryClear(L, sizeof(struct _NxLoad));
+    L->N = N;
+    L->kind = kind;
+    L->state = NX_LOAD_PENDING;
+
+    nxInt len = (nxInt)strlen(fileName) + 1;
+    L->fileName = (char *)NX_ALLOC(len);
+    nxMemoryCopy(fileName, L->fileName, len);
+
+    // Add to the end of the context's loads, so they are committed in order
+    NxLoad* link = &N->loads;
+    while (*link) link = &(*link)->next;
+    *link = L;
+
+    if (!N->loader) N->loader = nxLoaderOpen();
+
+    NxLoader* R = N->loader;
+    if (R)
+    {
+        nxMutexLock(&R->lock);
+        if (R->queueTail) R->queueTail->nextQueued = L; else R->queue = L;
+        R->queueTail = L;
+        nxCondSignal(&R->wake);
+        nxMutexUnlock(&R->lock);
+    }
+    else
+    {
+        // No thread, so read it now.  It is still committed at the next frame.
+        nxLoadRead(L);
+        L->read = NX_YES;
+    }
+
+    return L;
+}
+
+NxLoad nxPokeFileAsync(Next N, nxWord address, const char* fileName)
+{
+    NxLoad L = nxLoadStart(N, NX_LOAD_KIND_POKE, fileName);
+    L->address = address;
+    return L;
+}
+
+NxLoad nxNimReadAsync(Next N, const char* fileName)
+{
+    return nxLoadStart(N, NX_LOAD_KIND_NIM, fileName);
+}
+
+#ifdef NX_USE_STB
+
+NxLoad nxPngReadAsync(Next N, const char* fileName)
+{
+    return nxLoadStart(N, NX_LOAD_KIND_PNG, fileName);
+}
+
+#endif // NX_USE_STB
+
+NxLoadState nxPoll(NxLoad L)
+{
+    return L->state;
+}
+
+NxLoadState nxWait(NxLoad L)
+{
+    if (L->state != NX_LOAD_PENDING) return L->state;
+
+    NxLoader* R = L->N->loader;
+    if (R)
+    {
+        nxMutexLock(&R->lock);
+        while (!L->read) nxCondWait(&R->read, &R->lock);
+        nxMutexUnlock(&R->lock);
+    }
+
+    nxLoadCommit(L);
+    return L->state;
+}
+
+nxByte* nxLoadImage(NxLoad L, nxWord* width, nxWord* height)
+{
+    if (L->state != NX_LOAD_DONE || !L->image) return 0;
+
+    nxByte* img = L->image;
+    L->image = 0;
+    *width = L->width;
+    *height = L->height;
+    return img;
+}
+
+void nxLoadFree(NxLoad L)
+{
+    if (!L) return;
+
+    if (L->state == NX_LOAD_PENDING)
+    {
+        L->freed = NX_YES;
+    }
+    else
+    {
+        nxLoadRemove(L);
+    }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Fleets
+//
+// nxFleetRun hands each context to the worker pool as one job, so a context's frames all run on one thread, with its
+// memory warm in that core's cache.  The pool's shared job counter balances the load: a thread that finishes a
+// context just takes the next one, so there is no per-frame synchronisation at all.
+//----------------------------------------------------------------------------------------------------------------------
+
+struct _NxFleet
+{
+    Next*               contexts;
+    NxFleetResult*      results;
+    int                 count;
+    NxPool*             pool;
+
+    // Current run
+    NxFrameRoutine      func;
+    int                 frames;
+};
+
+NxFleet nxFleetOpen(int count, int numThreads)
+{
+    NxFleet F = (NxFleet)NX_ALLOC(sizeof(struct _NxFleet));
+    nxMemoryClear(F, sizeof(struct _NxFleet));
+
+    count = NX_MAX(count, 0);
+    F->count = count;
+    F->contexts = (Next *)NX_ALLOC(sizeof(Next) * NX_MAX(count, 1));
+    F->results = (NxFleetResult *)NX_ALLOC(sizeof(NxFleetResult) * NX_MAX(count, 1));
+    nxMemoryClear(F->results, sizeof(NxFleetResult) * NX_MAX(count, 1));
+
+    NxConfig config = { 0 };
+    config.headless = NX_YES;
+    for (int i = 0; i < count; ++i)
+    {
+        Next N = nxOpenEx(&config);
+        N->fleetIndex = i;
+        N->renderInterval = 0;
+        F->contexts[i] = N;
+    }
+
+    // No point having more threads than contexts
+    if (numThreads <= 0) numThreads = nxCpuCount();
+    numThreads = NX_MIN(numThreads, NX_MAX(count, 1));
+    F->pool = nxPoolOpen(numThreads - 1);
+
+    return F;
+}
+
+void nxFleetClose(NxFleet F)
+{
+    if (!F) return;
+
+    nxPoolClose(F->pool);
+    for (int i = 0; i < F->count; ++i) nxClose(F->contexts[i]);
+    NX_FREE(F->results);
+    NX_FREE(F->contexts);
+    NX_FREE(F);
+}
+
+int nxFleetCount(NxFleet F)
+{
+    return F->count;
+}
+
+Next nxFleetContext(NxFleet F, int index)
+{
+    return F->contexts[index];
+}
+
+int nxFleetIndex(Next N)
+{
+    return N->fleetIndex;
+}
+
+void nxFleetStop(Next N)
+{
+    N->fleetStop = NX_YES;
+}
+
+NxInternal void nxFleetJob(void* data, int index)
+{
+    NxFleet F = (NxFleet)data;
+    Next N = F->contexts[index];
+    NxFleetResult* R = &F->results[index];
+
+    N->fleetStop = NX_NO;
+    N->batch = NX_YES;
+    int frame = 0;
+    for (; frame < F->frames && !N->fleetStop; ++frame)
+    {
+        nxFrameStep(N, F->func);
+    }
+    N->batch = NX_NO;
+
+    R->frames += frame;
+    R->stopped = N->fleetStop;
+    R->frameHash = nxCrc32((void *)nxFrameBuffer(N), sizeof(nxDword) * NX_WINDOW_WIDTH * NX_WINDOW_HEIGHT);
+}
+
+void nxFleetRun(NxFleet F, NxFrameRoutine f, int frames)
+{
+    if (!F->count) return;
+
+    F->func = f;
+    F->frames = frames;
+    nxPoolRun(F->pool, &nxFleetJob, F, F->count);
+}
+
+void nxFleetGetResult(NxFleet F, int index, NxFleetResult* result)
+{
+    *result = F->results[index];
+}
+
 //----------------------------------------------------------------------------------------------------------------------
 //----------------------------------------------------------------------------------------------------------------------
 